@@ -0,0 +1,798 @@
+/* Log formats compiled from an Apache LogFormat or nginx log_format string.
+ *
+ * The format is compiled once into a list of fields, each followed by the
+ * literal text that separates it from the next one, like '" "' between
+ * the referer and the user agent of the Combined format. A line is split
+ * walking the list: every field ends where its literal is found, then the
+ * literal is skipped. No guess is made about where the fields are, so
+ * layouts like a virtual host before the client address, or the time to
+ * serve the request at the end, work like any other.
+ *
+ * Both the Apache '%' directives and the nginx '$' variables are
+ * understood, so the format can be copied from the server configuration.
+ * Directives not used by visitors are skipped.
+ *
+ * The "json" format is for logs with one JSON object per line, like the
+ * ones of nginx with escape=json or of Envoy: the object is scanned in
+ * place, the values of the known keys are nul terminated where they are,
+ * and everything else, nested objects included, is skipped.
+ *
+ * The "w3c" format is for the W3C extended logs of IIS: the columns are
+ * the ones of the last "#Fields:" directive, so the format can change in
+ * the middle of the file. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include "logformat.h"
+
+#ifdef VI_HAVE_PTHREADS
+#define VI_THREAD_LOCAL __thread
+#else
+#define VI_THREAD_LOCAL
+#endif
+
+/* Formats that can be specified by name */
+static struct {
+	const char *name;
+	const char *format;
+} vi_logformat_names[] = {
+	{"common", "%h %l %u %t \"%r\" %>s %b"},
+	{"combined", "%h %l %u %t \"%r\" %>s %b \"%{Referer}i\" \"%{User-agent}i\""},
+	{"vhost_combined", "%v:%p %h %l %u %t \"%r\" %>s %O \"%{Referer}i\" \"%{User-Agent}i\""},
+	{NULL, NULL}
+};
+
+/* Flags of the JSON keys */
+#define VI_JSON_DATE 1		/* ISO 8601 or Common Log Format date */
+#define VI_JSON_ADDRPORT 2	/* address with the port, like Envoy's */
+
+/* nginx variables used by visitors */
+static struct {
+	const char *name;
+	int field;
+} vi_logformat_vars[] = {
+	{"remote_addr", VI_FIELD_HOST},
+	{"time_local", VI_FIELD_DATE},
+	{"request", VI_FIELD_REQUEST},
+	{"http_referer", VI_FIELD_REFERER},
+	{"http_user_agent", VI_FIELD_AGENT},
+	{"status", VI_FIELD_STATUS},
+	{"body_bytes_sent", VI_FIELD_BYTES},
+	{"bytes_sent", VI_FIELD_BYTES},
+	{"request_time", VI_FIELD_DURATION},
+	{"host", VI_FIELD_VHOST},
+	{"server_name", VI_FIELD_VHOST},
+	{NULL, 0}
+};
+
+/* Keys of the JSON logs used by visitors */
+static struct {
+	const char *name;
+	int field;
+	int flags;
+} vi_logformat_keys[] = {
+	{"remote_addr", VI_FIELD_HOST, 0},
+	{"client_ip", VI_FIELD_HOST, 0},
+	{"downstream_remote_address", VI_FIELD_HOST, VI_JSON_ADDRPORT},
+	{"time_local", VI_FIELD_DATE, VI_JSON_DATE},
+	{"time_iso8601", VI_FIELD_DATE, VI_JSON_DATE},
+	{"start_time", VI_FIELD_DATE, VI_JSON_DATE},
+	{"timestamp", VI_FIELD_DATE, VI_JSON_DATE},
+	{"time", VI_FIELD_DATE, VI_JSON_DATE},
+	{"request", VI_FIELD_REQUEST, 0},
+	{"path", VI_FIELD_REQUEST, 0},
+	{"http_referer", VI_FIELD_REFERER, 0},
+	{"referer", VI_FIELD_REFERER, 0},
+	{"http_user_agent", VI_FIELD_AGENT, 0},
+	{"user_agent", VI_FIELD_AGENT, 0},
+	{"status", VI_FIELD_STATUS, 0},
+	{"response_code", VI_FIELD_STATUS, 0},
+	{"body_bytes_sent", VI_FIELD_BYTES, 0},
+	{"bytes_sent", VI_FIELD_BYTES, 0},
+	{"request_time", VI_FIELD_DURATION, 0},
+	{"host", VI_FIELD_VHOST, 0},
+	{"authority", VI_FIELD_VHOST, 0},
+	{NULL, 0, 0}
+};
+
+/* Columns of the W3C logs used by visitors */
+#define VI_W3C_QUERY -1		/* appended to the URL */
+#define VI_W3C_PLUS 1		/* '+' stands for a space */
+/* Max length of a "#Fields:" directive, see vi_logformat_seek() */
+#define VI_W3C_DIRECTIVE_MAX 1024
+
+static struct {
+	const char *name;
+	int field;
+	int flags;
+} vi_logformat_w3c[] = {
+	{"date", VI_FIELD_DATE, 0},
+	{"time", VI_FIELD_TIME, 0},
+	{"c-ip", VI_FIELD_HOST, 0},
+	{"cs-uri-stem", VI_FIELD_REQUEST, 0},
+	{"cs-uri-query", VI_W3C_QUERY, 0},
+	{"cs(Referer)", VI_FIELD_REFERER, 0},
+	{"cs(User-Agent)", VI_FIELD_AGENT, VI_W3C_PLUS},
+	{"sc-status", VI_FIELD_STATUS, 0},
+	{"sc-bytes", VI_FIELD_BYTES, 0},
+	{"time-taken", VI_FIELD_DURATION, 0},
+	{"cs-host", VI_FIELD_VHOST, 0},
+	{NULL, 0, 0}
+};
+
+/* The columns of the last "#Fields:" directive. Every thread has its
+ * own, as every thread reads its lines in order, unless others are set
+ * by vi_logformat_columns(). */
+static VI_THREAD_LOCAL struct vi_w3c_columns vi_w3c_own;
+static VI_THREAD_LOCAL struct vi_w3c_columns *vi_w3c_cur = NULL;
+#define vi_w3c (*(vi_w3c_cur ? vi_w3c_cur : &vi_w3c_own))
+
+/* Parse the Apache directive at 'p', after the '%'. The field is stored
+ * at 'field' and 'bracketed'. Returns the first character after the
+ * directive, or NULL on error. */
+static const char *vi_logformat_directive(struct vi_logformat *lf,
+		const char *p, int *field, int *bracketed, char *err,
+		size_t errlen)
+{
+	const char *arg = NULL;
+	int arglen = 0;
+
+	/* Modifiers, like in %>s or %!200,304{Referer}i */
+	while(*p == '<' || *p == '>' || *p == '!' || *p == ',' ||
+	      isdigit((unsigned char)*p)) p++;
+	if (*p == '{') {
+		const char *end = strchr(p, '}');
+
+		if (end == NULL) {
+			snprintf(err, errlen, "unterminated %%{ in log format");
+			return NULL;
+		}
+		arg = p+1;
+		arglen = end-arg;
+		p = end+1;
+	}
+	*field = VI_FIELD_SKIP;
+	*bracketed = 0;
+	switch(*p) {
+	case '\0':
+		snprintf(err, errlen, "incomplete %% directive in log format");
+		return NULL;
+	case 'h': case 'a': *field = VI_FIELD_HOST; break;
+	case 'r': *field = VI_FIELD_REQUEST; break;
+	case 's': *field = VI_FIELD_STATUS; break;
+	case 'b': case 'B': *field = VI_FIELD_BYTES; break;
+	case 'v': case 'V': *field = VI_FIELD_VHOST; break;
+	case 't':
+		if (arg) {
+			snprintf(err, errlen, "%%{...}t time formats are not "
+				"supported, use %%t");
+			return NULL;
+		}
+		*field = VI_FIELD_DATE;
+		*bracketed = 1;
+		break;
+	case 'D':
+		*field = VI_FIELD_DURATION;
+		lf->duration_unit = 1;
+		break;
+	case 'T':
+		*field = VI_FIELD_DURATION;
+		if (arg && arglen == 2 && !strncmp(arg, "ms", 2))
+			lf->duration_unit = 1000;
+		else if (arg && arglen == 2 && !strncmp(arg, "us", 2))
+			lf->duration_unit = 1;
+		else
+			lf->duration_unit = 1000000;
+		break;
+	case 'i':
+		if (arg && arglen == 7 && !strncasecmp(arg, "Referer", 7))
+			*field = VI_FIELD_REFERER;
+		else if (arg && arglen == 10 &&
+			 !strncasecmp(arg, "User-Agent", 10))
+			*field = VI_FIELD_AGENT;
+		break;
+	}
+	return p+1;
+}
+
+/* Parse the nginx variable at 'p', after the '$'. Returns the first
+ * character after the variable, or NULL on error. */
+static const char *vi_logformat_variable(struct vi_logformat *lf,
+		const char *p, int *field, char *err, size_t errlen)
+{
+	const char *name = p;
+	int len, j;
+
+	if (*p == '{') {
+		const char *end = strchr(p, '}');
+
+		if (end == NULL) {
+			snprintf(err, errlen, "unterminated ${ in log format");
+			return NULL;
+		}
+		name = p+1;
+		len = end-name;
+		p = end+1;
+	} else {
+		while(isalnum((unsigned char)*p) || *p == '_') p++;
+		len = p-name;
+	}
+	*field = VI_FIELD_SKIP;
+	for (j = 0; vi_logformat_vars[j].name; j++) {
+		if ((int)strlen(vi_logformat_vars[j].name) == len &&
+		    !strncmp(vi_logformat_vars[j].name, name, len))
+		{
+			*field = vi_logformat_vars[j].field;
+			break;
+		}
+	}
+	if (*field == VI_FIELD_DURATION) lf->duration_unit = 0;
+	return p;
+}
+
+/* Compile the Apache or nginx log format 'format', or one of the formats
+ * known by name like "combined". On error NULL is returned and the error
+ * is stored at 'err'. */
+struct vi_logformat *vi_logformat_compile(const char *format, char *err,
+		size_t errlen)
+{
+	struct vi_logformat *lf;
+	char *t, *start, **lit;
+	int *litlen, j, have[VI_FIELDS] = {0}, bracketed = 0;
+	const char *p;
+
+	if (!strcasecmp(format, "json")) {
+		if ((lf = calloc(1, sizeof(*lf))) == NULL) {
+			snprintf(err, errlen, "out of memory");
+			return NULL;
+		}
+		lf->lead = "";
+		lf->json = 1;
+		lf->mask = ~0U;
+		return lf;
+	}
+	if (!strcasecmp(format, "w3c") || !strcasecmp(format, "iis")) {
+		if ((lf = calloc(1, sizeof(*lf))) == NULL) {
+			snprintf(err, errlen, "out of memory");
+			return NULL;
+		}
+		lf->lead = "";
+		lf->w3c = 1;
+		lf->duration_unit = 1000;
+		lf->mask = ~0U;
+		return lf;
+	}
+	for (j = 0; vi_logformat_names[j].name; j++) {
+		if (!strcasecmp(format, vi_logformat_names[j].name)) {
+			format = vi_logformat_names[j].format;
+			break;
+		}
+	}
+	if ((lf = calloc(1, sizeof(*lf))) == NULL ||
+	    (lf->text = malloc(strlen(format)*2+2)) == NULL) {
+		snprintf(err, errlen, "out of memory");
+		goto err;
+	}
+	lf->mask = ~0U;
+	/* Every literal is copied in 'text', nul terminated. */
+	start = t = lf->text;
+	lit = &lf->lead;
+	litlen = &lf->leadlen;
+	for (p = format; *p; ) {
+		struct vi_logformat_item *it;
+		int field, fieldbracketed = 0;
+
+		if (*p == '\\' && p[1]) {
+			/* Escapes, as in the server configuration */
+			*t++ = p[1] == 'n' ? '\n' : p[1] == 't' ? '\t' : p[1];
+			p += 2;
+			continue;
+		} else if (*p == '%' && p[1] == '%') {
+			*t++ = '%';
+			p += 2;
+			continue;
+		} else if (*p == '%') {
+			p = vi_logformat_directive(lf, p+1, &field,
+				&fieldbracketed, err, errlen);
+		} else if (*p == '$' && (isalpha((unsigned char)p[1]) ||
+			   p[1] == '_' || p[1] == '{')) {
+			p = vi_logformat_variable(lf, p+1, &field, err,
+				errlen);
+		} else {
+			*t++ = *p++;
+			continue;
+		}
+		if (p == NULL) goto err;
+		/* A field: terminate the literal before it. */
+		*lit = start;
+		*litlen = t-start;
+		*t++ = '\0';
+		start = t;
+		if (lf->items && *litlen == 0 && !bracketed) {
+			snprintf(err, errlen, "fields without a separator "
+				"in log format");
+			goto err;
+		}
+		if (lf->items == VI_LOGFORMAT_ITEMS) {
+			snprintf(err, errlen, "too many fields in log format");
+			goto err;
+		}
+		it = &lf->item[lf->items++];
+		it->field = field;
+		it->bracketed = bracketed = fieldbracketed;
+		lit = &it->lit;
+		litlen = &it->litlen;
+		have[field] = 1;
+	}
+	*lit = start;
+	*litlen = t-start;
+	*t = '\0';
+	if (!have[VI_FIELD_HOST] || !have[VI_FIELD_DATE]) {
+		snprintf(err, errlen, "the log format must contain the client "
+			"address (%%h or $remote_addr) and the time (%%t or "
+			"$time_local)");
+		goto err;
+	}
+	return lf;
+
+err:
+	vi_logformat_free(lf);
+	return NULL;
+}
+
+/* Extract only the fields in 'mask', made of VI_FIELD_BIT() bits: the
+ * others are left empty by vi_logformat_split(), so the values of JSON
+ * keys and W3C columns not used are not even unescaped. */
+void vi_logformat_mask(struct vi_logformat *lf, unsigned int mask)
+{
+	int i;
+
+	lf->mask = mask;
+	for (i = 0; i < lf->items; i++)
+		if (!(mask & VI_FIELD_BIT(lf->item[i].field)))
+			lf->item[i].field = VI_FIELD_SKIP;
+}
+
+/* Find the literal 'lit' of 'len' bytes in 's'. */
+static char *vi_logformat_find(char *s, const char *lit, int len)
+{
+	while((s = strchr(s, lit[0])) != NULL) {
+		if (!strncmp(s, lit, len)) return s;
+		s++;
+	}
+	return NULL;
+}
+
+#define vi_json_space(c) ((c) == ' ' || (c) == '\t' || (c) == '\r')
+
+static int vi_hexval(int c)
+{
+	if (c >= '0' && c <= '9') return c-'0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f') return c-'a'+10;
+	return -1;
+}
+
+/* Return the closing quote of the JSON string at 'p', after the opening
+ * quote, or NULL if the string is not terminated. The string is not
+ * modified. */
+static char *vi_json_string_end(char *p)
+{
+	while(*p != '"') {
+		if (*p == '\0') return NULL;
+		if (*p == '\\' && p[1]) p++;
+		p++;
+	}
+	return p;
+}
+
+/* Scan the JSON string at 'p', after the opening quote. If 'unescape' is
+ * true the string is unescaped in place and nul terminated, otherwise it
+ * is just skipped. Returns the character after the closing quote, or NULL
+ * on error. The \xHH escapes of nginx without escape=json are accepted
+ * too. */
+static char *vi_json_string(char *p, int unescape)
+{
+	char *w = p;
+	int i, h, v;
+
+	if (!unescape)
+		return (p = vi_json_string_end(p)) ? p+1 : NULL;
+	while(*p != '"') {
+		if (*p == '\0') return NULL;
+		if (*p != '\\') {
+			*w++ = *p++;
+			continue;
+		}
+		p++;
+		switch(*p) {
+		case 'b': *w++ = '\b'; break;
+		case 'f': *w++ = '\f'; break;
+		case 'n': *w++ = '\n'; break;
+		case 'r': *w++ = '\r'; break;
+		case 't': *w++ = '\t'; break;
+		case 'u':
+		case 'x':
+			/* Encoded as UTF-8, that is never longer than the
+			 * escape. */
+			for (v = 0, i = 1; i <= (*p == 'u' ? 4 : 2); i++) {
+				if ((h = vi_hexval((unsigned char)p[i])) == -1)
+					return NULL;
+				v = v*16+h;
+			}
+			if (*p == 'x' || v < 0x80) {
+				*w++ = v;
+			} else if (v < 0x800) {
+				*w++ = 0xc0|(v>>6);
+				*w++ = 0x80|(v&0x3f);
+			} else {
+				*w++ = 0xe0|(v>>12);
+				*w++ = 0x80|((v>>6)&0x3f);
+				*w++ = 0x80|(v&0x3f);
+			}
+			p += i-1;
+			break;
+		case '\0': return NULL;
+		default: *w++ = *p; break;
+		}
+		p++;
+	}
+	*w = '\0';
+	return p+1;
+}
+
+/* Skip the JSON object or array at 'p'. Returns the character after it,
+ * or NULL on error. */
+static char *vi_json_skip(char *p)
+{
+	int depth = 0;
+
+	do {
+		if (*p == '"') {
+			/* Skipped strings are left as they are. */
+			if ((p = vi_json_string_end(p+1)) == NULL) return NULL;
+			p++;
+			continue;
+		}
+		if (*p == '{' || *p == '[') depth++;
+		else if (*p == '}' || *p == ']') depth--;
+		else if (*p == '\0') return NULL;
+		p++;
+	} while(depth);
+	return p;
+}
+
+/* Convert the ISO 8601 date 's', like "2000-10-10T13:55:36.123+02:00", to
+ * the format of the Common Log Format, like "10/Oct/2000:13:55:36 +0200",
+ * stored at 'dst'. Dates already in this format are copied. Returns -1 if
+ * the date is not valid or does not fit in 'len' bytes. */
+static int vi_json_date(char *dst, int len, const char *s)
+{
+	static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May",
+		"Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	int year, mon, day, hour, min, sec, n = 0, zh = 0, zm = 0;
+	char sign = 0;
+
+	if (sscanf(s, "%4d-%2d-%2d%*1[T ]%2d:%2d:%2d%n", &year, &mon, &day,
+			&hour, &min, &sec, &n) != 6 || n == 0) {
+		if ((int)strlen(s) >= len) return -1;
+		memmove(dst, s, strlen(s)+1);
+		return 0;
+	}
+	if (mon < 1 || mon > 12) return -1;
+	s += n;
+	if (*s == '.' || *s == ',')
+		for (s++; isdigit((unsigned char)*s); s++);
+	if (*s == 'Z') {
+		sign = '+';
+	} else if ((*s == '+' || *s == '-') &&
+		   (sscanf(s+1, "%2d:%2d", &zh, &zm) == 2 ||
+		    sscanf(s+1, "%2d%2d", &zh, &zm) == 2)) {
+		sign = *s;
+	}
+	if (sign)
+		n = snprintf(dst, len, "%02d/%s/%04d:%02d:%02d:%02d %c%02d%02d",
+			day, months[mon-1], year, hour, min, sec, sign, zh, zm);
+	else
+		n = snprintf(dst, len, "%02d/%s/%04d:%02d:%02d:%02d",
+			day, months[mon-1], year, hour, min, sec);
+	return (n < 0 || n >= len) ? -1 : 0;
+}
+
+/* Split the JSON object of the line 'l', see vi_logformat_split().
+ * Dates are converted in place: the key before the value gives enough
+ * room to the longer format. */
+static int vi_logformat_split_json(struct vi_logformat *lf, char *l,
+		char **field)
+{
+	char *p = l, *key, *val, *end;
+	int i, keylen, f, flags;
+
+	while(vi_json_space(*p)) p++;
+	if (*p++ != '{') return -1;
+	while(1) {
+		char delim;
+
+		while(vi_json_space(*p)) p++;
+		if (*p == '}') return 0;
+		if (*p != '"') return -1;
+		/* key */
+		key = p+1;
+		if ((p = vi_json_string_end(key)) == NULL) return -1;
+		keylen = p-key;
+		for (p++; vi_json_space(*p); p++);
+		if (*p++ != ':') return -1;
+		while(vi_json_space(*p)) p++;
+		f = VI_FIELD_SKIP;
+		flags = 0;
+		for (i = 0; vi_logformat_keys[i].name; i++) {
+			if (!strncmp(vi_logformat_keys[i].name, key, keylen) &&
+			    vi_logformat_keys[i].name[keylen] == '\0')
+			{
+				f = vi_logformat_keys[i].field;
+				flags = vi_logformat_keys[i].flags;
+				if (!(lf->mask & VI_FIELD_BIT(f)))
+					f = VI_FIELD_SKIP;
+				break;
+			}
+		}
+		/* value */
+		val = p;
+		delim = 0;
+		if (*p == '"') {
+			val = p+1;
+			if ((p = vi_json_string(val, f != VI_FIELD_SKIP)) == NULL)
+				return -1;
+			end = p;
+		} else if (*p == '{' || *p == '[') {
+			if ((p = vi_json_skip(p)) == NULL) return -1;
+			f = VI_FIELD_SKIP;
+			end = p;
+		} else {
+			/* Numbers, true, false, null. */
+			while(*p && *p != ',' && *p != '}' &&
+			      !vi_json_space(*p)) p++;
+			if (p == val || *p == '\0') return -1;
+			end = p;
+			delim = *p++;
+			if (f != VI_FIELD_SKIP) {
+				*end = '\0';
+				if (!strcmp(val, "null")) val = "";
+			}
+		}
+		if (f != VI_FIELD_SKIP) {
+			if (flags & VI_JSON_DATE) {
+				/* From the opening quote of the key to the
+				 * end of the value. */
+				if (vi_json_date(key-1, end-(key-1), val) == -1)
+					return -1;
+				val = key-1;
+			} else if (flags & VI_JSON_ADDRPORT) {
+				/* "1.2.3.4:80" or "[::1]:80" */
+				char *colon = strrchr(val, ':');
+
+				if (val[0] == '[' && colon && colon[-1] == ']') {
+					val++;
+					colon[-1] = '\0';
+				} else if (colon && strchr(val, ':') == colon) {
+					*colon = '\0';
+				}
+			}
+			field[f] = val;
+		}
+		if (!delim || vi_json_space(delim)) {
+			while(vi_json_space(*p)) p++;
+			delim = *p++;
+		}
+		if (delim == '}') return 0;
+		if (delim != ',') return -1;
+	}
+}
+
+/* Load the columns of the "#Fields:" directive 'l'. The line is not
+ * modified. With too many columns the ones after the last are ignored. */
+static void vi_w3c_fields(const char *l)
+{
+	const char *p = l+8, *name;
+	int i, len;
+
+	vi_w3c.cols = 0;
+	while(vi_w3c.cols < VI_LOGFORMAT_ITEMS) {
+		while(*p == ' ' || *p == '\t') p++;
+		if (*p == '\0' || *p == '\r' || *p == '\n') break;
+		name = p;
+		while(*p && *p != ' ' && *p != '\t' && *p != '\r' &&
+		      *p != '\n') p++;
+		len = p-name;
+		vi_w3c.field[vi_w3c.cols] = VI_FIELD_SKIP;
+		vi_w3c.flags[vi_w3c.cols] = 0;
+		for (i = 0; vi_logformat_w3c[i].name; i++) {
+			if (!strncasecmp(vi_logformat_w3c[i].name, name,
+					len) &&
+			    vi_logformat_w3c[i].name[len] == '\0')
+			{
+				vi_w3c.field[vi_w3c.cols] =
+					vi_logformat_w3c[i].field;
+				vi_w3c.flags[vi_w3c.cols] =
+					vi_logformat_w3c[i].flags;
+				break;
+			}
+		}
+		vi_w3c.cols++;
+	}
+}
+
+/* The last day converted by vi_w3c_day(): the lines of a log are in
+ * order, so the conversion is done about once per day. */
+struct vi_w3c_day_cache {
+	char iso[11];		/* like "2000-10-10", empty if not set */
+	char day[VI_W3C_DAY_MAX];	/* like "10/Oct/2000" */
+};
+static VI_THREAD_LOCAL struct vi_w3c_day_cache vi_w3c_day_cache;
+
+/* Return the day of the W3C date 'iso', like "2000-10-10", in the format
+ * of the Common Log Format, like "10/Oct/2000", or NULL if the date is
+ * not valid. The string is overwritten when the same thread splits a
+ * line of another day, so a parsed line must be processed before the
+ * next one is split. */
+static char *vi_w3c_day(const char *iso)
+{
+	static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May",
+		"Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+	struct vi_w3c_day_cache *dc = &vi_w3c_day_cache;
+	int year, mon, day;
+
+	if (dc->iso[0] && !strcmp(dc->iso, iso)) return dc->day;
+	if (strlen(iso) != 10 ||
+	    sscanf(iso, "%4d-%2d-%2d", &year, &mon, &day) != 3 ||
+	    mon < 1 || mon > 12 || day < 1 || day > 31) return NULL;
+	snprintf(dc->day, sizeof(dc->day), "%02d/%s/%04d", day,
+		months[mon-1], year);
+	memcpy(dc->iso, iso, 11);
+	return dc->day;
+}
+
+/* Split the line 'l' of a W3C extended log, see vi_logformat_split().
+ * The date is returned in the format of the Common Log Format, and the
+ * time in the VI_FIELD_TIME field. Returns 1 for the directives, loading
+ * the columns of "#Fields:". */
+static int vi_logformat_split_w3c(struct vi_logformat *lf, char *l,
+		char **field)
+{
+	char *p = l, *end, *stem = NULL, *query = NULL;
+	int i, f;
+
+	if (*p == '#') {
+		if (!strncmp(p, "#Fields:", 8)) vi_w3c_fields(p);
+		return 1;
+	}
+	if (vi_w3c.cols == 0) return -1;
+	for (i = 0; i < vi_w3c.cols; i++) {
+		if (*p == '\0') return -1;
+		for (end = p; *end && *end != ' ' && *end != '\t' &&
+		     *end != '\r'; end++);
+		f = vi_w3c.field[i];
+		if (!(lf->mask & VI_FIELD_BIT(f == VI_W3C_QUERY ?
+				VI_FIELD_REQUEST : f))) f = VI_FIELD_SKIP;
+		if (f == VI_W3C_QUERY) {
+			query = p;
+		} else if (f != VI_FIELD_SKIP) {
+			field[f] = p;
+			if (vi_w3c.flags[i] & VI_W3C_PLUS) {
+				char *s;
+
+				for (s = p; s < end; s++)
+					if (*s == '+') *s = ' ';
+			}
+			if (f == VI_FIELD_REQUEST) stem = p;
+		}
+		if (*end == '\0') {
+			p = end;
+		} else {
+			*end = '\0';
+			p = end+1;
+		}
+	}
+	/* The query follows the URL like in "/index.asp?id=10" if the
+	 * columns are next to each other, as usual. */
+	if (query && stem && query == stem+strlen(stem)+1 &&
+	    strcmp(query, "-")) query[-1] = '?';
+	if ((field[VI_FIELD_DATE] = vi_w3c_day(field[VI_FIELD_DATE])) == NULL)
+		return -1;
+	return 0;
+}
+
+/* Use the columns 'c' for the next W3C lines, like when the lines of
+ * multiple logs are interleaved, or the thread's own if 'c' is NULL. */
+void vi_logformat_columns(struct vi_w3c_columns *c)
+{
+	vi_w3c_cur = c;
+}
+
+/* Load the W3C columns from the last "#Fields:" directive of the 'len'
+ * bytes of lines at 'buf', that are not split yet. If there is none the
+ * columns are left as they are. Nothing to do for the other formats. */
+void vi_logformat_follow(struct vi_logformat *lf, char *buf, size_t len)
+{
+	char line[VI_W3C_DIRECTIVE_MAX], *p, *nl;
+	size_t j, l;
+
+	if (!lf || !lf->w3c) return;
+	for (j = len; j > 0; j--) {
+		if (buf[j-1] == '#' && (j == 1 || buf[j-2] == '\n') &&
+		    len-(j-1) >= 8 && !memcmp(buf+j-1, "#Fields:", 8))
+			break;
+	}
+	if (j == 0) return;
+	/* The directive is not nul terminated: copy it. */
+	p = buf+j-1;
+	if ((nl = memchr(p, '\n', len-(j-1))) == NULL) nl = buf+len;
+	l = nl-p;
+	if (l >= sizeof(line)) l = sizeof(line)-1;
+	memcpy(line, p, l);
+	line[l] = '\0';
+	vi_w3c_fields(line);
+}
+
+/* Prepare to split the lines of the log at 'buf' starting at the offset
+ * 'start', that may be in the middle of the log: the W3C columns are
+ * loaded from the last "#Fields:" directive between the offsets 'from'
+ * and 'start'. If there is none the columns are left as they are, or
+ * reset if 'from' is zero, that is the start of the log. Nothing to do
+ * for the other formats. */
+void vi_logformat_seek(struct vi_logformat *lf, char *buf, size_t from,
+		size_t start)
+{
+	if (!lf || !lf->w3c) return;
+	if (from == 0) vi_w3c.cols = 0;
+	if (start > from) vi_logformat_follow(lf, buf+from, start-from);
+}
+
+/* Split the line 'l' in place with the format 'lf'. The fields are stored
+ * in 'field', indexed by VI_FIELD_*: the ones missing in the format are
+ * set to the empty string. Returns -1 if the line does not match the
+ * format, 1 if it is not a log entry, like the W3C directives. */
+int vi_logformat_split(struct vi_logformat *lf, char *l, char **field)
+{
+	char *p = l, *end;
+	int i;
+
+	for (i = 0; i < VI_FIELDS; i++) field[i] = "";
+	if (lf->json) return vi_logformat_split_json(lf, l, field);
+	if (lf->w3c) return vi_logformat_split_w3c(lf, l, field);
+	if (strncmp(p, lf->lead, lf->leadlen)) return -1;
+	p += lf->leadlen;
+	for (i = 0; i < lf->items; i++) {
+		struct vi_logformat_item *it = &lf->item[i];
+
+		if (it->bracketed) {
+			if (*p != '[' || (end = strchr(p, ']')) == NULL ||
+			    strncmp(end+1, it->lit, it->litlen)) return -1;
+			field[it->field] = p+1;
+			*end = '\0';
+			p = end+1+it->litlen;
+		} else if (it->litlen == 0) {
+			/* The last field takes the rest of the line. */
+			field[it->field] = p;
+			p += strlen(p);
+		} else {
+			if ((end = vi_logformat_find(p, it->lit,
+					it->litlen)) == NULL) return -1;
+			field[it->field] = p;
+			*end = '\0';
+			p = end+it->litlen;
+		}
+	}
+	return 0;
+}
+
+void vi_logformat_free(struct vi_logformat *lf)
+{
+	if (!lf) return;
+	free(lf->text);
+	free(lf);
+}
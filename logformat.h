@@ -0,0 +1,75 @@
+/* Log formats compiled from an Apache LogFormat or nginx log_format string */
+
+#ifndef __VI_LOGFORMAT_H
+#define __VI_LOGFORMAT_H
+
+#include <stddef.h>
+
+/* Fields of a log line */
+#define VI_FIELD_SKIP 0		/* not used by visitors */
+#define VI_FIELD_HOST 1
+#define VI_FIELD_DATE 2		/* like "10/Oct/2000:13:55:36 -0700" */
+#define VI_FIELD_REQUEST 3	/* like "GET / HTTP/1.1" */
+#define VI_FIELD_REFERER 4
+#define VI_FIELD_AGENT 5
+#define VI_FIELD_STATUS 6
+#define VI_FIELD_BYTES 7
+#define VI_FIELD_DURATION 8
+#define VI_FIELD_VHOST 9
+#define VI_FIELD_TIME 10	/* like "13:55:36" when the date has its own
+				   field, in UTC, like in W3C logs */
+#define VI_FIELDS 11
+
+/* Bit of a field in the masks of vi_logformat_mask() */
+#define VI_FIELD_BIT(f) (1U << (f))
+
+/* Max number of fields of a format */
+#define VI_LOGFORMAT_ITEMS 64
+
+/* Size of the day of a W3C line in VI_FIELD_DATE, like "10/Oct/2000". It
+ * is valid until the next line is split, see vi_logformat_split(). */
+#define VI_W3C_DAY_MAX 12
+
+/* The columns of a W3C log, from its last "#Fields:" directive */
+struct vi_w3c_columns {
+	int cols;			/* zero if no directive was seen */
+	int field[VI_LOGFORMAT_ITEMS];
+	int flags[VI_LOGFORMAT_ITEMS];
+};
+
+/* A field, and the literal text that follows it in the line. */
+struct vi_logformat_item {
+	int field;
+	int bracketed;		/* the value is inside [], like Apache %t */
+	char *lit;
+	int litlen;
+};
+
+/* The program to split a line: the literal text before the first field,
+ * then the fields. */
+struct vi_logformat {
+	char *lead;
+	int leadlen;
+	int items;
+	struct vi_logformat_item item[VI_LOGFORMAT_ITEMS];
+	int duration_unit;	/* microseconds of the unit of the duration,
+				   0 for seconds with a fraction */
+	int json;		/* one JSON object per line, see
+				   vi_logformat_split_json() */
+	int w3c;		/* W3C extended log, see
+				   vi_logformat_split_w3c() */
+	unsigned int mask;	/* fields to extract, see vi_logformat_mask() */
+	char *text;		/* storage of the literals */
+};
+
+struct vi_logformat *vi_logformat_compile(const char *format, char *err,
+		size_t errlen);
+int vi_logformat_split(struct vi_logformat *lf, char *l, char **field);
+void vi_logformat_mask(struct vi_logformat *lf, unsigned int mask);
+void vi_logformat_columns(struct vi_w3c_columns *c);
+void vi_logformat_follow(struct vi_logformat *lf, char *buf, size_t len);
+void vi_logformat_seek(struct vi_logformat *lf, char *buf, size_t from,
+		size_t start);
+void vi_logformat_free(struct vi_logformat *lf);
+
+#endif /* __VI_LOGFORMAT_H */
@@ -0,0 +1,808 @@
+/* Readers for plain and compressed log files.
+ *
+ * A reader returns the log data in blocks, decompressing it in-process
+ * if the input is gzip, bzip2 or xz compressed. The compression format
+ * is detected by magic bytes, so the file name does not matter.
+ * Concatenated compressed streams are handled like zcat(1) does.
+ *
+ * The input can be a file descriptor or a memory area, typically a
+ * file mapped in memory, so that compressed data is not copied at all
+ * before being decompressed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#ifdef VI_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef VI_HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef VI_HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef VI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "reader.h"
+
+/* Return the input type looking at the first 'len' bytes of data. */
+int vi_reader_detect(const void *p, size_t len)
+{
+	const unsigned char *m = p;
+
+	if (len >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+		return VI_READER_GZIP;
+	if (len >= 3 && m[0] == 'B' && m[1] == 'Z' && m[2] == 'h')
+		return VI_READER_BZIP2;
+	if (len >= 6 && !memcmp(m, "\xfd" "7zXZ\0", 6))
+		return VI_READER_XZ;
+	return VI_READER_PLAIN;
+}
+
+const char *vi_reader_type_name(int type)
+{
+	switch(type) {
+	case VI_READER_GZIP: return "gzip";
+	case VI_READER_BZIP2: return "bzip2";
+	case VI_READER_XZ: return "xz";
+	default: return "plain";
+	}
+}
+
+static void vi_reader_set_error(struct vi_reader *r, const char *fmt,
+		const char *arg)
+{
+	snprintf(r->error, sizeof(r->error), fmt, arg);
+}
+
+/* Refill the input buffer if empty. Returns -1 on read error. */
+static int vi_reader_fill(struct vi_reader *r)
+{
+	long nread;
+
+	if (r->avail || r->eof) return 0;
+	do {
+		nread = read(r->fd, r->buf, VI_READER_BUFLEN);
+	} while (nread == -1 && errno == EINTR);
+	if (nread == -1) {
+		vi_reader_set_error(r, "Reading: %s", strerror(errno));
+		return -1;
+	}
+	if (nread == 0) r->eof = 1;
+	r->next = r->buf;
+	r->avail = nread;
+	return 0;
+}
+
+/* Return non-zero if there is more compressed input after the end of
+ * a stream, starting with the magic of the same format. Trailing
+ * garbage (for example zero padding) is ignored like zcat does. */
+static int vi_reader_more_streams(struct vi_reader *r)
+{
+	if (vi_reader_fill(r) == -1) return 0;
+	if (r->avail == 0) return 0;
+	/* The magic may be split across two reads, but this is a so
+	 * unlikely case that it is not worth to handle it. */
+	return vi_reader_detect(r->next, r->avail) == r->type;
+}
+
+/* ------------------------------ decompressors ----------------------------- */
+#ifdef VI_HAVE_ZLIB
+static int vi_gzip_init(struct vi_reader *r)
+{
+	z_stream *zs = calloc(1, sizeof(*zs));
+
+	if (!zs || inflateInit2(zs, 15+16) != Z_OK) {
+		free(zs);
+		return -1;
+	}
+	r->state = zs;
+	return 0;
+}
+
+static long vi_gzip_read(struct vi_reader *r, char *buf, long len)
+{
+	z_stream *zs = r->state;
+
+	zs->next_out = (unsigned char*) buf;
+	zs->avail_out = len;
+	while(zs->avail_out == (unsigned) len) {
+		int ret;
+
+		if (vi_reader_fill(r) == -1) return -1;
+		if (r->avail == 0) {
+			vi_reader_set_error(r, "%s", "Unexpected end of gzip data");
+			return -1;
+		}
+		zs->next_in = r->next;
+		zs->avail_in = r->avail;
+		ret = inflate(zs, Z_NO_FLUSH);
+		r->next = zs->next_in;
+		r->avail = zs->avail_in;
+		if (ret == Z_STREAM_END) {
+			if (!vi_reader_more_streams(r)) {
+				r->done = 1;
+				break;
+			}
+			inflateReset(zs);
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			vi_reader_set_error(r, "Corrupted gzip data: %s",
+				zs->msg ? zs->msg : "unknown error");
+			return -1;
+		}
+	}
+	return len - zs->avail_out;
+}
+
+static void vi_gzip_free(struct vi_reader *r)
+{
+	inflateEnd(r->state);
+	free(r->state);
+}
+#endif
+
+#ifdef VI_HAVE_BZIP2
+static int vi_bzip2_init(struct vi_reader *r)
+{
+	bz_stream *bs = calloc(1, sizeof(*bs));
+
+	if (!bs || BZ2_bzDecompressInit(bs, 0, 0) != BZ_OK) {
+		free(bs);
+		return -1;
+	}
+	r->state = bs;
+	return 0;
+}
+
+static long vi_bzip2_read(struct vi_reader *r, char *buf, long len)
+{
+	bz_stream *bs = r->state;
+
+	bs->next_out = buf;
+	bs->avail_out = len;
+	while(bs->avail_out == (unsigned) len) {
+		int ret;
+
+		if (vi_reader_fill(r) == -1) return -1;
+		if (r->avail == 0) {
+			vi_reader_set_error(r, "%s", "Unexpected end of bzip2 data");
+			return -1;
+		}
+		bs->next_in = (char*) r->next;
+		bs->avail_in = r->avail;
+		ret = BZ2_bzDecompress(bs);
+		r->next = (unsigned char*) bs->next_in;
+		r->avail = bs->avail_in;
+		if (ret == BZ_STREAM_END) {
+			if (!vi_reader_more_streams(r)) {
+				r->done = 1;
+				break;
+			}
+			/* Multi stream file, like the ones created
+			 * by pbzip2: start again. */
+			BZ2_bzDecompressEnd(bs);
+			if (BZ2_bzDecompressInit(bs, 0, 0) != BZ_OK) {
+				vi_reader_set_error(r, "%s", "Out of memory");
+				return -1;
+			}
+		} else if (ret != BZ_OK) {
+			vi_reader_set_error(r, "%s", "Corrupted bzip2 data");
+			return -1;
+		}
+	}
+	return len - bs->avail_out;
+}
+
+static void vi_bzip2_free(struct vi_reader *r)
+{
+	BZ2_bzDecompressEnd(r->state);
+	free(r->state);
+}
+#endif
+
+#ifdef VI_HAVE_LZMA
+static int vi_xz_init(struct vi_reader *r)
+{
+	lzma_stream init = LZMA_STREAM_INIT;
+	lzma_stream *ls = malloc(sizeof(*ls));
+
+	if (!ls) return -1;
+	*ls = init;
+	if (lzma_stream_decoder(ls, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+		free(ls);
+		return -1;
+	}
+	r->state = ls;
+	return 0;
+}
+
+static long vi_xz_read(struct vi_reader *r, char *buf, long len)
+{
+	lzma_stream *ls = r->state;
+
+	ls->next_out = (unsigned char*) buf;
+	ls->avail_out = len;
+	while(ls->avail_out == (size_t) len) {
+		lzma_ret ret;
+
+		if (vi_reader_fill(r) == -1) return -1;
+		ls->next_in = r->next;
+		ls->avail_in = r->avail;
+		/* With LZMA_CONCATENATED the decoder needs to be told
+		 * when the input is over. */
+		ret = lzma_code(ls, r->avail == 0 ? LZMA_FINISH : LZMA_RUN);
+		r->next = (unsigned char*) ls->next_in;
+		r->avail = ls->avail_in;
+		if (ret == LZMA_STREAM_END) {
+			r->done = 1;
+			break;
+		} else if (ret != LZMA_OK) {
+			vi_reader_set_error(r, "%s", ret == LZMA_BUF_ERROR ?
+				"Unexpected end of xz data" : "Corrupted xz data");
+			return -1;
+		}
+	}
+	return len - ls->avail_out;
+}
+
+static void vi_xz_free(struct vi_reader *r)
+{
+	lzma_end(r->state);
+	free(r->state);
+}
+#endif
+
+#if defined(VI_HAVE_ZLIB) && defined(VI_HAVE_PTHREADS)
+/* ----------------------------- parallel gzip ------------------------------ */
+/* Logs compressed with pigz, rotated logs concatenated together, or
+ * files where gzip output was appended many times, are made of many
+ * independent gzip members. Such files are split in jobs starting at
+ * what looks like a member header, and the jobs are inflated by a pool
+ * of threads. Data is returned in order as usually.
+ *
+ * A job always ends at the end of a member, so it may run past the
+ * start of the next job if the header was a false positive, or if a
+ * member is bigger than the job size. In this case the chain of
+ * members is broken: the pool is stopped and the rest of the file is
+ * inflated sequentially after the end of the last verified member.
+ * With single member files the first job spans the whole file, so
+ * decompression still runs in parallel with parsing. */
+
+#define VI_PGZ_JOBLEN (8*1024*1024)	/* compressed bytes per job */
+#define VI_PGZ_BLOCKLEN (1024*1024)	/* decompressed bytes per block */
+#define VI_PGZ_BLOCKS_PER_THREAD 8	/* max blocks queued per thread */
+
+#define VI_PGZ_QUEUED 0
+#define VI_PGZ_RUNNING 1
+#define VI_PGZ_DONE 2
+#define VI_PGZ_FAILED 3
+
+struct vi_pgz_block {
+	struct vi_pgz_block *next;
+	size_t len;
+	char *data;
+};
+
+struct vi_pgz_job {
+	size_t start;		/* offset of the first member */
+	size_t end;		/* job ends at the first member end >= 'end' */
+	size_t realend;		/* where the last member really ended */
+	int state;
+	struct vi_pgz_block *head, *tail; /* output not yet consumed */
+};
+
+struct vi_pgz {
+	const unsigned char *data;
+	size_t size;
+	struct vi_pgz_job *job;
+	int jobs;
+	int nextjob;		/* next job to start */
+	int cur;		/* job we are returning data from */
+	int blocks;		/* blocks allocated and not yet consumed */
+	int maxblocks;
+	int stop;		/* ask the threads to exit ASAP */
+	int nthreads;
+	pthread_t *thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct vi_pgz_block *block; /* block we are returning data from */
+	size_t blockpos;
+	struct vi_reader *seq;	/* sequential reader after a broken chain */
+};
+
+/* Return non-zero if 'p' looks like the start of a gzip member. Besides
+ * the magic, check the deflate method, the reserved flags, and that the
+ * extra flags and the OS fields have valid values. */
+static int vi_pgz_is_header(const unsigned char *p, size_t len)
+{
+	if (len < 10) return 0;
+	return p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 &&
+		(p[3] & 0xe0) == 0 &&
+		(p[8] == 0 || p[8] == 2 || p[8] == 4) &&
+		(p[9] <= 13 || p[9] == 255);
+}
+
+/* Return the offset of the first member header at or after 'from',
+ * or 'size' if there is none. */
+static size_t vi_pgz_find_header(const unsigned char *p, size_t size,
+		size_t from)
+{
+	while(from < size) {
+		const unsigned char *h = memchr(p+from, 0x1f, size-from);
+
+		if (h == NULL) break;
+		if (vi_pgz_is_header(h, size-(h-p))) return h-p;
+		from = (h-p)+1;
+	}
+	return size;
+}
+
+/* Allocate an output block for job 'j', waiting if too many blocks are
+ * already queued. The job we are returning data from never waits, as
+ * its blocks are consumed while it runs. Returns NULL if the pool is
+ * stopping or on out of memory. */
+static struct vi_pgz_block *vi_pgz_block_new(struct vi_pgz *pgz, int j)
+{
+	struct vi_pgz_block *b;
+
+	pthread_mutex_lock(&pgz->lock);
+	while(!pgz->stop && pgz->blocks >= pgz->maxblocks && j != pgz->cur)
+		pthread_cond_wait(&pgz->cond, &pgz->lock);
+	if (pgz->stop) {
+		pthread_mutex_unlock(&pgz->lock);
+		return NULL;
+	}
+	pgz->blocks++;
+	pthread_mutex_unlock(&pgz->lock);
+	if ((b = malloc(sizeof(*b)+VI_PGZ_BLOCKLEN)) == NULL) return NULL;
+	b->next = NULL;
+	b->len = 0;
+	b->data = (char*) (b+1);
+	return b;
+}
+
+/* Inflate all the members of job 'j'. */
+static void vi_pgz_run(struct vi_pgz *pgz, int j)
+{
+	struct vi_pgz_job *job = &pgz->job[j];
+	size_t pos = job->start;
+	int state = VI_PGZ_FAILED, ret = Z_OK;
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 15+16) != Z_OK) goto end;
+	while(1) {
+		struct vi_pgz_block *b = vi_pgz_block_new(pgz, j);
+
+		if (b == NULL) break;
+		zs.next_out = (unsigned char*) b->data;
+		zs.avail_out = VI_PGZ_BLOCKLEN;
+		ret = Z_OK;
+		while(zs.avail_out && ret == Z_OK) {
+			if (zs.avail_in == 0) {
+				size_t left = pgz->size-pos;
+
+				if (left == 0) {
+					ret = Z_BUF_ERROR; /* truncated */
+					break;
+				}
+				/* avail_in is 32 bit, feed big files
+				 * in pieces. */
+				zs.next_in = (unsigned char*) pgz->data+pos;
+				zs.avail_in = left > (1<<30) ? (1<<30) : left;
+			}
+			pos += zs.avail_in;
+			ret = inflate(&zs, Z_NO_FLUSH);
+			pos -= zs.avail_in;
+		}
+		b->len = VI_PGZ_BLOCKLEN - zs.avail_out;
+		pthread_mutex_lock(&pgz->lock);
+		if (job->tail) job->tail->next = b;
+		else job->head = b;
+		job->tail = b;
+		pthread_cond_broadcast(&pgz->cond);
+		pthread_mutex_unlock(&pgz->lock);
+		if (ret != Z_OK && ret != Z_STREAM_END) break;
+		if (ret == Z_STREAM_END) {
+			/* Trailing garbage after the last member is
+			 * ignored, like zcat does. */
+			if (!vi_pgz_is_header(pgz->data+pos, pgz->size-pos)) {
+				job->realend = pgz->size;
+				state = VI_PGZ_DONE;
+				break;
+			}
+			if (pos >= job->end) {
+				job->realend = pos;
+				state = VI_PGZ_DONE;
+				break;
+			}
+			inflateReset(&zs);
+			zs.avail_in = 0;
+		}
+	}
+	inflateEnd(&zs);
+end:
+	pthread_mutex_lock(&pgz->lock);
+	job->state = state;
+	pthread_cond_broadcast(&pgz->cond);
+	pthread_mutex_unlock(&pgz->lock);
+}
+
+static void *vi_pgz_thread(void *arg)
+{
+	struct vi_pgz *pgz = arg;
+
+	pthread_mutex_lock(&pgz->lock);
+	while(!pgz->stop && pgz->nextjob < pgz->jobs) {
+		int j = pgz->nextjob++;
+
+		pgz->job[j].state = VI_PGZ_RUNNING;
+		pthread_mutex_unlock(&pgz->lock);
+		vi_pgz_run(pgz, j);
+		pthread_mutex_lock(&pgz->lock);
+	}
+	pthread_mutex_unlock(&pgz->lock);
+	return NULL;
+}
+
+/* Stop and join the threads, and release all the queued output. */
+static void vi_pgz_stop(struct vi_pgz *pgz)
+{
+	int j;
+
+	pthread_mutex_lock(&pgz->lock);
+	pgz->stop = 1;
+	pthread_cond_broadcast(&pgz->cond);
+	pthread_mutex_unlock(&pgz->lock);
+	for (j = 0; j < pgz->nthreads; j++)
+		pthread_join(pgz->thread[j], NULL);
+	pgz->nthreads = 0;
+	for (j = 0; j < pgz->jobs; j++) {
+		struct vi_pgz_block *b = pgz->job[j].head;
+
+		while(b) {
+			struct vi_pgz_block *next = b->next;
+			free(b);
+			b = next;
+		}
+		pgz->job[j].head = pgz->job[j].tail = NULL;
+	}
+	free(pgz->block);
+	pgz->block = NULL;
+}
+
+static void vi_pgz_free(struct vi_reader *r)
+{
+	struct vi_pgz *pgz = r->state;
+
+	vi_pgz_stop(pgz);
+	if (pgz->seq) vi_reader_free(pgz->seq);
+	pthread_mutex_destroy(&pgz->lock);
+	pthread_cond_destroy(&pgz->cond);
+	free(pgz->thread);
+	free(pgz->job);
+	free(pgz);
+}
+
+/* Setup the jobs and start the pool. Returns -1 on error. */
+static int vi_pgz_init(struct vi_reader *r, int nthreads)
+{
+	struct vi_pgz *pgz;
+	size_t pos = 0;
+	int j;
+
+	if ((pgz = calloc(1, sizeof(*pgz))) == NULL) return -1;
+	pgz->data = r->next;
+	pgz->size = r->avail;
+	pgz->maxblocks = nthreads*VI_PGZ_BLOCKS_PER_THREAD;
+	/* Split the file at the first header after every VI_PGZ_JOBLEN
+	 * bytes. */
+	while(1) {
+		struct vi_pgz_job *job;
+
+		if (pgz->jobs % 64 == 0) {
+			job = realloc(pgz->job, sizeof(*job)*(pgz->jobs+64));
+			if (job == NULL) goto err;
+			pgz->job = job;
+		}
+		job = &pgz->job[pgz->jobs++];
+		memset(job, 0, sizeof(*job));
+		job->start = pos;
+		if (pgz->size-pos <= VI_PGZ_JOBLEN) {
+			job->end = pgz->size;
+			break;
+		}
+		pos = vi_pgz_find_header(pgz->data, pgz->size, pos+VI_PGZ_JOBLEN);
+		job->end = pos;
+		if (pos == pgz->size) break;
+	}
+	if (nthreads > pgz->jobs+1) nthreads = pgz->jobs+1;
+	if ((pgz->thread = malloc(sizeof(pthread_t)*nthreads)) == NULL)
+		goto err;
+	pthread_mutex_init(&pgz->lock, NULL);
+	pthread_cond_init(&pgz->cond, NULL);
+	r->state = pgz;
+	for (j = 0; j < nthreads; j++) {
+		if (pthread_create(&pgz->thread[j], NULL, vi_pgz_thread, pgz))
+			break;
+		pgz->nthreads++;
+	}
+	if (pgz->nthreads == 0) {
+		vi_pgz_free(r);
+		r->state = NULL;
+		return -1;
+	}
+	return 0;
+err:
+	free(pgz->job);
+	free(pgz);
+	return -1;
+}
+
+/* Switch to a sequential reader starting at 'pos'. */
+static int vi_pgz_sequential(struct vi_reader *r, size_t pos)
+{
+	struct vi_pgz *pgz = r->state;
+
+	vi_pgz_stop(pgz);
+	pgz->seq = vi_reader_new_mem(pgz->data+pos, pgz->size-pos);
+	if (pgz->seq == NULL) {
+		vi_reader_set_error(r, "%s", "Out of memory");
+		return -1;
+	}
+	return 0;
+}
+
+static long vi_pgz_read(struct vi_reader *r, char *buf, long len)
+{
+	struct vi_pgz *pgz = r->state;
+	long n;
+
+	if (pgz->seq) {
+		if ((n = vi_reader_read(pgz->seq, buf, len)) == -1)
+			vi_reader_set_error(r, "%s", vi_reader_error(pgz->seq));
+		return n;
+	}
+	pthread_mutex_lock(&pgz->lock);
+	while(pgz->block == NULL) {
+		struct vi_pgz_job *job = &pgz->job[pgz->cur];
+
+		if (job->head) {
+			pgz->block = job->head;
+			pgz->blockpos = 0;
+			job->head = job->head->next;
+			if (job->head == NULL) job->tail = NULL;
+		} else if (job->state == VI_PGZ_FAILED) {
+			pthread_mutex_unlock(&pgz->lock);
+			vi_reader_set_error(r, "%s", "Corrupted gzip data");
+			return -1;
+		} else if (job->state == VI_PGZ_DONE) {
+			size_t realend = job->realend;
+
+			if (pgz->cur+1 == pgz->jobs || realend == pgz->size) {
+				pthread_mutex_unlock(&pgz->lock);
+				r->done = 1;
+				return 0;
+			}
+			if (pgz->job[pgz->cur+1].start != realend) {
+				/* Broken chain, see the top comment. */
+				pthread_mutex_unlock(&pgz->lock);
+				if (vi_pgz_sequential(r, realend) == -1)
+					return -1;
+				return vi_pgz_read(r, buf, len);
+			}
+			pgz->cur++;
+			pthread_cond_broadcast(&pgz->cond);
+		} else {
+			pthread_cond_wait(&pgz->cond, &pgz->lock);
+		}
+	}
+	pthread_mutex_unlock(&pgz->lock);
+
+	n = pgz->block->len - pgz->blockpos;
+	if (n > len) n = len;
+	memcpy(buf, pgz->block->data+pgz->blockpos, n);
+	pgz->blockpos += n;
+	if (pgz->blockpos == pgz->block->len) {
+		free(pgz->block);
+		pthread_mutex_lock(&pgz->lock);
+		pgz->block = NULL;
+		pgz->blocks--;
+		pthread_cond_broadcast(&pgz->cond);
+		pthread_mutex_unlock(&pgz->lock);
+	}
+	/* Empty blocks are possible at the end of a job. */
+	if (n == 0 && len) return vi_pgz_read(r, buf, len);
+	return n;
+}
+#endif
+
+/* --------------------------------- API ------------------------------------ */
+/* Setup the decompressor for the detected type. Returns -1 on error. */
+static int vi_reader_init(struct vi_reader *r)
+{
+	int retval = -2;
+
+	r->type = vi_reader_detect(r->next, r->avail);
+	switch(r->type) {
+	case VI_READER_PLAIN:
+		return 0;
+#ifdef VI_HAVE_ZLIB
+	case VI_READER_GZIP:
+		retval = vi_gzip_init(r);
+		break;
+#endif
+#ifdef VI_HAVE_BZIP2
+	case VI_READER_BZIP2:
+		retval = vi_bzip2_init(r);
+		break;
+#endif
+#ifdef VI_HAVE_LZMA
+	case VI_READER_XZ:
+		retval = vi_xz_init(r);
+		break;
+#endif
+	}
+	if (retval == -2)
+		vi_reader_set_error(r, "Visitors was compiled without %s support",
+				vi_reader_type_name(r->type));
+	else if (retval == -1)
+		vi_reader_set_error(r, "%s", "Out of memory");
+	return retval ? -1 : 0;
+}
+
+/* Create a reader for the file descriptor 'fd'. The first bytes are
+ * read in order to detect the compression format. Returns NULL on out
+ * of memory, on I/O errors, or when the format is not supported,
+ * the error is written in the reader otherwise, so
+ * vi_reader_error() should be called and then the reader freed. */
+struct vi_reader *vi_reader_new_fd(int fd)
+{
+	struct vi_reader *r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL) return NULL;
+	if ((r->buf = malloc(VI_READER_BUFLEN)) == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->fd = fd;
+	r->next = r->buf;
+	/* Read at least the longest magic, or everything up to EOF. */
+	while(r->avail < 6 && !r->eof) {
+		long nread = read(fd, r->buf+r->avail, VI_READER_BUFLEN-r->avail);
+
+		if (nread == -1) {
+			if (errno == EINTR) continue;
+			vi_reader_set_error(r, "Reading: %s", strerror(errno));
+			r->done = 1;
+			return r;
+		}
+		if (nread == 0) r->eof = 1;
+		r->avail += nread;
+	}
+	if (vi_reader_init(r) == -1) r->done = 1;
+	return r;
+}
+
+/* Create a reader for the 'len' bytes of data at 'p'. Data must remain
+ * valid until the reader is freed. Returns NULL on out of memory. */
+struct vi_reader *vi_reader_new_mem(const void *p, size_t len)
+{
+	struct vi_reader *r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL) return NULL;
+	r->fd = -1;
+	r->next = (unsigned char*) p;
+	r->avail = len;
+	r->eof = 1;
+	if (vi_reader_init(r) == -1) r->done = 1;
+	return r;
+}
+
+/* Like vi_reader_new_mem(), but gzip data is inflated by a pool of
+ * 'nthreads' threads when possible. */
+struct vi_reader *vi_reader_new_mem_mt(const void *p, size_t len, int nthreads)
+{
+	struct vi_reader *r = vi_reader_new_mem(p, len);
+
+#if defined(VI_HAVE_ZLIB) && defined(VI_HAVE_PTHREADS)
+	if (r && r->type == VI_READER_GZIP && !r->done && nthreads > 1) {
+		void *seqstate = r->state;
+
+		if (vi_pgz_init(r, nthreads) == 0) {
+			r->parallel = 1;
+			inflateEnd(seqstate);
+			free(seqstate);
+		} else {
+			r->state = seqstate;
+		}
+	}
+#else
+	nthreads = nthreads; /* avoid warning */
+#endif
+	return r;
+}
+
+/* Read up to 'len' bytes of log data in 'buf'. Returns the number of
+ * bytes read, zero at the end of the data, or -1 on error. */
+long vi_reader_read(struct vi_reader *r, char *buf, long len)
+{
+	if (r->error[0]) return -1;
+	if (r->done || len == 0) return 0;
+#if defined(VI_HAVE_ZLIB) && defined(VI_HAVE_PTHREADS)
+	if (r->parallel) return vi_pgz_read(r, buf, len);
+#endif
+	switch(r->type) {
+	case VI_READER_PLAIN:
+		/* Return the bytes read for the detection first. */
+		if (r->avail || r->eof) {
+			long n = (long)r->avail < len ? (long)r->avail : len;
+
+			memcpy(buf, r->next, n);
+			r->next += n;
+			r->avail -= n;
+			return n;
+		} else {
+			long nread;
+
+			do {
+				nread = read(r->fd, buf, len);
+			} while (nread == -1 && errno == EINTR);
+			if (nread == -1)
+				vi_reader_set_error(r, "Reading: %s",
+						strerror(errno));
+			return nread;
+		}
+#ifdef VI_HAVE_ZLIB
+	case VI_READER_GZIP: return vi_gzip_read(r, buf, len);
+#endif
+#ifdef VI_HAVE_BZIP2
+	case VI_READER_BZIP2: return vi_bzip2_read(r, buf, len);
+#endif
+#ifdef VI_HAVE_LZMA
+	case VI_READER_XZ: return vi_xz_read(r, buf, len);
+#endif
+	}
+	return -1;
+}
+
+/* Return the last error, or NULL if there was no error. */
+const char *vi_reader_error(struct vi_reader *r)
+{
+	return r->error[0] ? r->error : NULL;
+}
+
+/* Release the reader. The file descriptor is not closed. */
+void vi_reader_free(struct vi_reader *r)
+{
+#if defined(VI_HAVE_ZLIB) && defined(VI_HAVE_PTHREADS)
+	if (r->parallel) {
+		vi_pgz_free(r);
+		r->state = NULL;
+	}
+#endif
+	if (r->state) {
+		switch(r->type) {
+#ifdef VI_HAVE_ZLIB
+		case VI_READER_GZIP: vi_gzip_free(r); break;
+#endif
+#ifdef VI_HAVE_BZIP2
+		case VI_READER_BZIP2: vi_bzip2_free(r); break;
+#endif
+#ifdef VI_HAVE_LZMA
+		case VI_READER_XZ: vi_xz_free(r); break;
+#endif
+		}
+	}
+	free(r->buf);
+	free(r);
+}
@@ -0,0 +1,39 @@
+/* Readers for plain and compressed log files */
+
+#ifndef __VI_READER_H
+#define __VI_READER_H
+
+#include <stddef.h>
+
+/* Input types, detected looking at the first bytes of data */
+#define VI_READER_PLAIN 0
+#define VI_READER_GZIP 1
+#define VI_READER_BZIP2 2
+#define VI_READER_XZ 3
+
+/* Size of the buffer used to read compressed input from a descriptor */
+#define VI_READER_BUFLEN (1024*1024)
+
+struct vi_reader {
+	int type;
+	int fd;			/* -1 when reading from memory */
+	unsigned char *buf;	/* input buffer, only used with descriptors */
+	unsigned char *next;	/* next input byte to consume */
+	size_t avail;		/* input bytes available at 'next' */
+	int eof;		/* no more input after the 'avail' bytes */
+	int done;		/* end of the decompressed data reached */
+	int parallel;		/* decompression done by a pool of threads */
+	void *state;		/* decompressor state */
+	char error[128];
+};
+
+int vi_reader_detect(const void *p, size_t len);
+const char *vi_reader_type_name(int type);
+struct vi_reader *vi_reader_new_fd(int fd);
+struct vi_reader *vi_reader_new_mem(const void *p, size_t len);
+struct vi_reader *vi_reader_new_mem_mt(const void *p, size_t len, int nthreads);
+long vi_reader_read(struct vi_reader *r, char *buf, long len);
+const char *vi_reader_error(struct vi_reader *r);
+void vi_reader_free(struct vi_reader *r);
+
+#endif /* __VI_READER_H */
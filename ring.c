@@ -0,0 +1,101 @@
+/* Bounded lock-free single-producer/single-consumer rings.
+ *
+ * Every ring connects exactly one producer thread to one consumer
+ * thread. vi_ring_push() and vi_ring_pop() never block: they just fail
+ * if the ring is full or empty. vi_ring_put() and vi_ring_get() wait
+ * instead, spinning for a short time and then sleeping, so that a stage
+ * waiting for I/O does not burn a core. */
+
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+
+#include "ring.h"
+
+/* Create a ring able to hold 'size' pointers, rounded to the next power
+ * of two. Returns NULL on out of memory. */
+struct vi_ring *vi_ring_new(unsigned long size)
+{
+	struct vi_ring *r;
+	unsigned long realsize = 1;
+
+	while(realsize < size) realsize <<= 1;
+	if ((r = calloc(1, sizeof(*r))) == NULL) return NULL;
+	if ((r->slot = malloc(sizeof(void*)*realsize)) == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->size = realsize;
+	return r;
+}
+
+void vi_ring_free(struct vi_ring *r)
+{
+	if (!r) return;
+	free(r->slot);
+	free(r);
+}
+
+/* Add 'ptr' to the ring. Returns zero if the ring is full.
+ * Only the producer thread can call this function. */
+int vi_ring_push(struct vi_ring *r, void *ptr)
+{
+	unsigned long head = r->head;
+
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->size)
+		return 0;
+	r->slot[head & (r->size-1)] = ptr;
+	__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Remove the oldest pointer from the ring storing it at 'ptr'.
+ * Returns zero if the ring is empty.
+ * Only the consumer thread can call this function. */
+int vi_ring_pop(struct vi_ring *r, void **ptr)
+{
+	unsigned long tail = r->tail;
+
+	if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		return 0;
+	*ptr = r->slot[tail & (r->size-1)];
+	__atomic_store_n(&r->tail, tail+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* Wait for the other side of a ring, 'spins' is the number of times
+ * we already waited. */
+static void vi_ring_wait(int spins)
+{
+	if (spins < 64) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		__builtin_ia32_pause();
+#endif
+	} else if (spins < 128) {
+		sched_yield();
+	} else {
+		struct timespec ts = {0, 50000};
+
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Like vi_ring_push() but waits for a free slot. */
+void vi_ring_put(struct vi_ring *r, void *ptr)
+{
+	int spins = 0;
+
+	while(!vi_ring_push(r, ptr))
+		vi_ring_wait(spins++);
+}
+
+/* Like vi_ring_pop() but waits for a pointer, that is returned. */
+void *vi_ring_get(struct vi_ring *r)
+{
+	void *ptr;
+	int spins = 0;
+
+	while(!vi_ring_pop(r, &ptr))
+		vi_ring_wait(spins++);
+	return ptr;
+}
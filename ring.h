@@ -0,0 +1,24 @@
+/* Bounded lock-free single-producer/single-consumer rings */
+
+#ifndef __VI_RING_H
+#define __VI_RING_H
+
+/* The producer only writes 'head' and the consumer only writes 'tail',
+ * on different cache lines, so the two sides never share a lock. */
+struct vi_ring {
+	unsigned long head;	/* next slot to write */
+	char pad1[64-sizeof(unsigned long)];
+	unsigned long tail;	/* next slot to read */
+	char pad2[64-sizeof(unsigned long)];
+	unsigned long size;	/* number of slots, a power of two */
+	void **slot;
+};
+
+struct vi_ring *vi_ring_new(unsigned long size);
+void vi_ring_free(struct vi_ring *r);
+int vi_ring_push(struct vi_ring *r, void *ptr);
+int vi_ring_pop(struct vi_ring *r, void **ptr);
+void vi_ring_put(struct vi_ring *r, void *ptr);
+void *vi_ring_get(struct vi_ring *r);
+
+#endif /* __VI_RING_H */
@@ -4,6 +4,20 @@
 
 #include "sleep.h"
 
+#ifdef __linux__
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#endif
+
+/* Size of the buffer used to copy data when it can't be sent directly */
+#define TAILOUT_BUFLEN (64*1024)
+
 /* Open a file, seek at the end, and store in '*len' the file length */
 static FILE *vi_openAtEnd(char *filename, long *len)
 {
@@ -20,19 +34,23 @@ err:
 
 /* Output 'len' bytes of file 'fp' starting from 'offset'.
  * The function returns 0 on success, -1 on error. */
-#define TAILOUT_BUFLEN 1024
 static int vi_tailOutput(FILE *fp, long offset, long len)
 {
-	char buf[TAILOUT_BUFLEN];
+	static char buf[TAILOUT_BUFLEN];
+	int retval = 0;
+
 	if (fseek(fp, offset, SEEK_SET) == -1) return -1;
 	while(len) {
 		unsigned int min = (len > TAILOUT_BUFLEN) ? TAILOUT_BUFLEN : len;
-		if (fread(buf, 1, min, fp) != min) return -1;
+		if (fread(buf, 1, min, fp) != min) {
+			retval = -1;
+			break;
+		}
 		fwrite(buf, 1, min, stdout);
-		fflush(stdout);
 		len -= min;
 	}
-	return 0;
+	fflush(stdout);
+	return retval;
 }
 
 /* An interation for the 'tail -f' simulation. Open the
@@ -62,16 +80,13 @@ static void vi_tailIteration(char *filename, long *len)
 	if (fp != NULL) fclose(fp);
 }
 
-void vi_tail(int filec, char **filev)
+/* Check all the files every second. Used when inotify is not available. */
+static void vi_tailPoll(int filec, char **filev)
 {
 	long *len;
 	int i;
-	
-	if (filec <= 0) {
-		fprintf(stderr, "No files specified in tail-mode\n");
-		exit(1);
-	}
-	len = malloc(filec);
+
+	len = malloc(filec*sizeof(long));
 	if (!len) {
 		fprintf(stderr, "Out of memory\n");
 		exit(1);
@@ -85,3 +100,194 @@ void vi_tail(int filec, char **filev)
 		vi_sleep(1);
 	}
 }
+
+#ifdef __linux__
+/* With inotify we are woken up as soon as a file is modified, moved,
+ * or created again in its directory after a rotation. Files are still
+ * checked every second, as inotify does not work on every filesystem.
+ * New data is sent to the standard output with sendfile(2), that uses
+ * splice internally, so it is never copied in user space. */
+
+struct vi_tailfile {
+	char *filename;
+	const char *base;	/* name of the file inside its directory */
+	int fd;			/* -1 if the file is missing */
+	off_t offset;		/* bytes already output */
+	dev_t dev;		/* identity of the open file */
+	ino_t ino;
+	int wd;			/* watch of the file */
+	int dirwd;		/* watch of the directory */
+	int dirty;		/* an event was received for the file */
+};
+
+/* Output the data of 'fd' from '*offset' to 'end', updating the offset.
+ * Returns 0 on success, -1 on error. */
+static int vi_tailSend(int fd, off_t *offset, off_t end)
+{
+	static int nosendfile = 0;
+	static char buf[TAILOUT_BUFLEN];
+
+	while(*offset < end) {
+		ssize_t n, left = end - *offset;
+
+		if (!nosendfile) {
+			n = sendfile(STDOUT_FILENO, fd, offset, left);
+			if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+				/* Not supported for this output, like
+				 * terminals or files opened for append. */
+				nosendfile = 1;
+				continue;
+			}
+		} else {
+			if (left > TAILOUT_BUFLEN) left = TAILOUT_BUFLEN;
+			n = pread(fd, buf, left, *offset);
+			if (n > 0) {
+				ssize_t w = 0, nw;
+
+				while(w < n) {
+					nw = write(STDOUT_FILENO, buf+w, n-w);
+					if (nw == -1 && errno == EINTR) continue;
+					if (nw == -1) return -1;
+					w += nw;
+				}
+				*offset += n;
+			}
+		}
+		if (n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+		if (n <= 0) return -1;
+	}
+	return 0;
+}
+
+/* Open the file, at its end if 'atend' is true, and watch it.
+ * Returns -1 if the file can't be opened. */
+static int vi_tailOpen(int ifd, struct vi_tailfile *tf, int atend)
+{
+	struct stat sb;
+
+	if ((tf->fd = open(tf->filename, O_RDONLY)) == -1) return -1;
+	if (fstat(tf->fd, &sb) == -1) {
+		close(tf->fd);
+		tf->fd = -1;
+		return -1;
+	}
+	tf->offset = atend ? sb.st_size : 0;
+	tf->dev = sb.st_dev;
+	tf->ino = sb.st_ino;
+	tf->wd = inotify_add_watch(ifd, tf->filename,
+			IN_MODIFY|IN_MOVE_SELF|IN_DELETE_SELF|IN_ATTRIB);
+	return 0;
+}
+
+static void vi_tailClose(int ifd, struct vi_tailfile *tf)
+{
+	if (tf->wd != -1) inotify_rm_watch(ifd, tf->wd);
+	close(tf->fd);
+	tf->fd = -1;
+	tf->wd = -1;
+}
+
+/* Output the new data of a file. If the file was rotated the rest of
+ * the old file is output, then the new one is output from the start. */
+static void vi_tailCheck(int ifd, struct vi_tailfile *tf)
+{
+	struct stat sb;
+
+	if (tf->fd == -1 && vi_tailOpen(ifd, tf, 0) == -1) return;
+	if (fstat(tf->fd, &sb) == 0) {
+		if (sb.st_size < tf->offset)
+			tf->offset = 0; /* truncated */
+		if (sb.st_size > tf->offset)
+			vi_tailSend(tf->fd, &tf->offset, sb.st_size);
+	}
+	/* Keep following the old file until a new one is created. */
+	if (stat(tf->filename, &sb) == 0 &&
+	    (sb.st_dev != tf->dev || sb.st_ino != tf->ino))
+	{
+		vi_tailClose(ifd, tf);
+		if (vi_tailOpen(ifd, tf, 0) == 0 && fstat(tf->fd, &sb) == 0)
+			vi_tailSend(tf->fd, &tf->offset, sb.st_size);
+	}
+}
+
+void vi_tail(int filec, char **filev)
+{
+	struct vi_tailfile *tf;
+	long evbuf[1024];
+	int ifd, i;
+
+	if (filec <= 0) {
+		fprintf(stderr, "No files specified in tail-mode\n");
+		exit(1);
+	}
+	if ((ifd = inotify_init()) == -1) {
+		vi_tailPoll(filec, filev);
+		return;
+	}
+	if ((tf = calloc(filec, sizeof(*tf))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	fflush(stdout);
+	for (i = 0; i < filec; i++) {
+		char *dir, *slash = strrchr(filev[i], '/');
+
+		tf[i].filename = filev[i];
+		tf[i].base = slash ? slash+1 : filev[i];
+		tf[i].fd = tf[i].wd = -1;
+		if (slash == NULL) {
+			dir = ".";
+		} else if ((dir = strdup(filev[i])) != NULL) {
+			dir[slash-filev[i]+(slash == filev[i])] = '\0';
+		}
+		if (dir == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		tf[i].dirwd = inotify_add_watch(ifd, dir, IN_CREATE|IN_MOVED_TO);
+		if (slash) free(dir);
+		vi_tailOpen(ifd, &tf[i], 1);
+	}
+	while(1) {
+		struct pollfd pfd;
+		ssize_t n;
+		char *p;
+
+		pfd.fd = ifd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0) {
+			/* Timeout: check all the files anyway. */
+			for (i = 0; i < filec; i++) tf[i].dirty = 1;
+		} else if ((n = read(ifd, evbuf, sizeof(evbuf))) > 0) {
+			for (p = (char*)evbuf; p < (char*)evbuf+n;
+			     p += sizeof(struct inotify_event) +
+				  ((struct inotify_event*)p)->len)
+			{
+				struct inotify_event *ev = (struct inotify_event*)p;
+
+				for (i = 0; i < filec; i++) {
+					if (ev->mask & IN_Q_OVERFLOW ||
+					    (tf[i].wd != -1 && ev->wd == tf[i].wd) ||
+					    (ev->wd == tf[i].dirwd && ev->len &&
+					     !strcmp(ev->name, tf[i].base)))
+						tf[i].dirty = 1;
+				}
+			}
+		}
+		for (i = 0; i < filec; i++) {
+			if (!tf[i].dirty) continue;
+			tf[i].dirty = 0;
+			vi_tailCheck(ifd, &tf[i]);
+		}
+	}
+}
+#else
+void vi_tail(int filec, char **filev)
+{
+	if (filec <= 0) {
+		fprintf(stderr, "No files specified in tail-mode\n");
+		exit(1);
+	}
+	vi_tailPoll(filec, filev);
+}
+#endif
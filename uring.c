@@ -0,0 +1,268 @@
+/* Minimal io_uring interface to read files asynchronously.
+ *
+ * Only what visitors needs is implemented, using the raw system calls so
+ * that liburing is not required: a ring where reads are queued into a
+ * set of buffers, registered in the kernel when possible so that pages
+ * are not mapped again for every read, and a way to wait for the
+ * completions. When io_uring is not available vi_uring_new() returns
+ * NULL and the caller falls back to plain read(2).
+ *
+ * A buffer can be the target of a single read at a time. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "uring.h"
+
+#if defined(VI_HAVE_URING) && defined(__linux__)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct vi_uring {
+	int fd;
+	/* submission queue */
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* completion queue */
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* mappings of the rings shared with the kernel */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned int queued;	/* entries not yet submitted */
+	int fixed;		/* buffers registered */
+	struct iovec *iov;	/* the buffers */
+	int nbufs;
+};
+
+/* Create a ring for up to 'entries' reads in flight, reading into the
+ * 'nbufs' buffers of 'bufsize' bytes at 'bufs'.
+ * Returns NULL if io_uring is not available or on out of memory. */
+struct vi_uring *vi_uring_new(unsigned int entries, char **bufs, long bufsize,
+		int nbufs)
+{
+	struct io_uring_params p;
+	struct vi_uring *u;
+	char *sq, *cq;
+	int j;
+
+	if ((u = calloc(1, sizeof(*u))) == NULL) return NULL;
+	if ((u->iov = malloc(sizeof(struct iovec)*nbufs)) == NULL) {
+		free(u);
+		return NULL;
+	}
+	u->nbufs = nbufs;
+	for (j = 0; j < nbufs; j++) {
+		u->iov[j].iov_base = bufs[j];
+		u->iov[j].iov_len = bufsize;
+	}
+	memset(&p, 0, sizeof(p));
+	if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		free(u->iov);
+		free(u);
+		return NULL;
+	}
+	u->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries*sizeof(struct io_uring_cqe);
+	u->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	/* Newer kernels map both the rings at once. */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_size > u->sq_ring_size)
+			u->sq_ring_size = u->cq_ring_size;
+		u->cq_ring_size = 0;
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) goto err;
+	if (u->cq_ring_size) {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) goto err;
+	} else {
+		u->cq_ring = u->sq_ring;
+	}
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) goto err;
+	sq = u->sq_ring;
+	cq = u->cq_ring;
+	u->sq_head = (unsigned int*)(sq+p.sq_off.head);
+	u->sq_tail = (unsigned int*)(sq+p.sq_off.tail);
+	u->sq_mask = (unsigned int*)(sq+p.sq_off.ring_mask);
+	u->sq_entries = (unsigned int*)(sq+p.sq_off.ring_entries);
+	u->sq_array = (unsigned int*)(sq+p.sq_off.array);
+	u->cq_head = (unsigned int*)(cq+p.cq_off.head);
+	u->cq_tail = (unsigned int*)(cq+p.cq_off.tail);
+	u->cq_mask = (unsigned int*)(cq+p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+	/* Registering the buffers may fail because of the locked memory
+	 * limit: in this case plain vectored reads are used. */
+	u->fixed = syscall(__NR_io_uring_register, u->fd,
+			IORING_REGISTER_BUFFERS, u->iov, nbufs) == 0;
+	return u;
+err:
+	if (u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_size);
+	if (u->cq_ring_size && u->cq_ring && u->cq_ring != MAP_FAILED)
+		munmap(u->cq_ring, u->cq_ring_size);
+	close(u->fd);
+	free(u->iov);
+	free(u);
+	return NULL;
+}
+
+/* Free the ring. There must be no reads in flight. */
+void vi_uring_free(struct vi_uring *u)
+{
+	if (!u) return;
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring_size) munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+	free(u->iov);
+	free(u);
+}
+
+/* Queue a read of 'len' bytes at 'offset' of 'fd' into 'p', that is
+ * inside the buffer number 'buf'. 'data' is returned by vi_uring_wait()
+ * when the read completes. Returns non-zero on error. */
+int vi_uring_read(struct vi_uring *u, int fd, int buf, char *p, long len,
+		off_t offset, unsigned long data)
+{
+	unsigned int tail = *u->sq_tail, idx;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+	    *u->sq_entries) {
+		if (vi_uring_submit(u)) return 1;
+		if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+		    *u->sq_entries) {
+			errno = EBUSY;
+			return 1;
+		}
+	}
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	if (u->fixed) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (unsigned long) p;
+		sqe->len = len;
+		sqe->buf_index = buf;
+	} else {
+		u->iov[buf].iov_base = p;
+		u->iov[buf].iov_len = len;
+		sqe->opcode = IORING_OP_READV;
+		sqe->addr = (unsigned long) &u->iov[buf];
+		sqe->len = 1;
+	}
+	sqe->fd = fd;
+	sqe->off = offset;
+	sqe->user_data = data;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail+1, __ATOMIC_RELEASE);
+	u->queued++;
+	return 0;
+}
+
+/* Submit the queued reads to the kernel. Returns non-zero on error. */
+int vi_uring_submit(struct vi_uring *u)
+{
+	while(u->queued) {
+		int ret = syscall(__NR_io_uring_enter, u->fd, u->queued, 0, 0,
+				NULL, 0);
+
+		if (ret == -1) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		u->queued -= ret;
+	}
+	return 0;
+}
+
+/* Wait for a read to complete, submitting the queued ones. The 'data'
+ * of the read and its result, the number of bytes read or -errno, are
+ * stored at 'data' and 'res'. Returns non-zero on error. */
+int vi_uring_wait(struct vi_uring *u, unsigned long *data, long *res)
+{
+	while(1) {
+		unsigned int head = *u->cq_head;
+		int ret;
+
+		if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+			*data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(u->cq_head, head+1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		ret = syscall(__NR_io_uring_enter, u->fd, u->queued, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret == -1) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		u->queued -= ret;
+	}
+}
+
+/* Return non-zero if the reads use registered buffers. */
+int vi_uring_fixed(struct vi_uring *u)
+{
+	return u->fixed;
+}
+
+#else /* !VI_HAVE_URING */
+
+struct vi_uring *vi_uring_new(unsigned int entries, char **bufs, long bufsize,
+		int nbufs)
+{
+	entries = entries;
+	bufs = bufs;
+	bufsize = bufsize;
+	nbufs = nbufs;
+	errno = ENOSYS;
+	return NULL;
+}
+
+void vi_uring_free(struct vi_uring *u)
+{
+	u = u;
+}
+
+int vi_uring_read(struct vi_uring *u, int fd, int buf, char *p, long len,
+		off_t offset, unsigned long data)
+{
+	u = u; fd = fd; buf = buf; p = p; len = len; offset = offset;
+	data = data;
+	errno = ENOSYS;
+	return 1;
+}
+
+int vi_uring_submit(struct vi_uring *u)
+{
+	u = u;
+	errno = ENOSYS;
+	return 1;
+}
+
+int vi_uring_wait(struct vi_uring *u, unsigned long *data, long *res)
+{
+	u = u; data = data; res = res;
+	errno = ENOSYS;
+	return 1;
+}
+
+int vi_uring_fixed(struct vi_uring *u)
+{
+	u = u;
+	return 0;
+}
+
+#endif /* VI_HAVE_URING */
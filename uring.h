@@ -0,0 +1,19 @@
+/* Minimal io_uring interface to read files asynchronously */
+
+#ifndef __VI_URING_H
+#define __VI_URING_H
+
+#include <sys/types.h>
+
+struct vi_uring;
+
+struct vi_uring *vi_uring_new(unsigned int entries, char **bufs, long bufsize,
+		int nbufs);
+void vi_uring_free(struct vi_uring *u);
+int vi_uring_read(struct vi_uring *u, int fd, int buf, char *p, long len,
+		off_t offset, unsigned long data);
+int vi_uring_submit(struct vi_uring *u);
+int vi_uring_wait(struct vi_uring *u, unsigned long *data, long *res);
+int vi_uring_fixed(struct vi_uring *u);
+
+#endif /* __VI_URING_H */
@@ -14,22 +14,79 @@
 #include <errno.h>
 #include <locale.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <glob.h>
+#define VI_HAVE_MMAP
+#define VI_HAVE_GLOB
+#else
+#include <io.h>
+/* Single threaded here, see --threads */
+#define localtime_r(t,tm) (*(tm) = *localtime(t), (tm))
+#endif
+#ifdef VI_HAVE_PTHREADS
+#include <pthread.h>
+#endif
+#ifdef __linux__
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define VI_HAVE_EPOLL
+#endif
 
 #include "aht.h"
 #include "antigetopt.h"
 #include "sleep.h"
 #include "blacklist.h"
+#include "reader.h"
+#include "ring.h"
+#include "uring.h"
+#include "logformat.h"
 
 /* Max length of an error stored in the visitors handle */
 #define VI_ERROR_MAX 1024
 /* Max length of a log line */
 #define VI_LINE_MAX 4096
+/* Max number of threads, see --threads */
+#define VI_THREADS_MAX 256
+/* Min size of the ranges a big log file is split in, see --threads */
+#define VI_SPLIT_MIN (1024*1024)
+/* Size of the blocks read from files that can't be mapped in memory */
+#define VI_READ_CHUNK (4*1024*1024)
+/* Reads in flight and size of the blocks read with --io-uring */
+#define VI_ASYNC_BUFS 8
+#define VI_ASYNC_CHUNK (1024*1024)
 /* Max number of filenames in the command line */
 #define VI_FILENAMES_MAX 1024
+/* Lines looked at by a probe of the --from --to binary search before to
+ * give up, when they are all invalid */
+#define VI_PERIOD_TRIES 64
+/* Probes used to check if a log file is sorted by time */
+#define VI_PERIOD_PROBES 16
+/* Seconds an entry can precede the one before it in a file that is
+ * still considered sorted: requests are logged when they complete, and
+ * local times go back one hour when daylight saving time ends. */
+#define VI_PERIOD_SLACK (2*3600)
+/* Lookahead buffer of every log file read with --merge */
+#define VI_MERGE_BUFLEN (64*1024)
+/* Max number of --family patterns in the command line */
+#define VI_FAMILIES_MAX 64
+/* Bytes read from a log file looking for its first entry */
+#define VI_FIRST_BLOCK (64*1024)
 /* Max number of prefixes in the command line */
 #define VI_PREFIXES_MAX 1024
 /* Max number of --grep --exclude patterns in the command line */
 #define VI_GREP_PATTERNS_MAX 1024
+/* Max number of stream mode sources in the command line */
+#define VI_STREAM_SOURCES_MAX 256
 /* Abbreviation length for HTML outputs */
 #define VI_HTML_ABBR_LEN 100
 /* Version as a string */
@@ -77,9 +134,34 @@ struct vih {
         struct hashtable googlehumanlanguage;
         struct hashtable screenres;
         struct hashtable screendepth;
+	int threads;		/* threads available to decompress data */
+	int defer;		/* defer new visits to vi_merge() */
+	int seen;		/* the line is not a new visit, see
+				   vi_process_visitors_per_day() */
+	struct vi_visit *visits;	/* deferred new visits */
+	struct vi_visit *visits_tail;
 	char *error;
 };
 
+/* A new visit deferred by a worker thread. Only the first worker can
+ * know if a visit is really new: for the others the same visit may be
+ * already in the data processed by the previous workers, so the reports
+ * generated only for new visits are computed by vi_merge(). */
+struct vi_visit {
+	struct vi_visit *next;
+	int google;		/* it's about googlevisitors */
+	char *key;		/* NULL for lines that are not tracked, like
+				   the ones of bots: they are new visits if
+				   the line before them is */
+	char *date;
+	char *host;		/* line fields, NULL for google visits */
+	char *agent;
+	char *ref;
+	char *req;
+	time_t time;
+	struct tm tm;
+};
+
 /* info associated with a line of log */
 struct logline {
 	char *host;
@@ -91,6 +173,10 @@ struct logline {
 	char *agent;
 	time_t time;
 	struct tm tm;
+	int status;		/* HTTP status code, 0 if unknown */
+	long bytes;		/* size of the response, -1 if unknown */
+	long duration;		/* time to serve the request in microseconds,
+				   -1 if unknown */
 };
 
 /* output module structure. See below for the definition of
@@ -129,6 +215,15 @@ struct greppat {
     char *pattern;
 };
 
+/* Stream mode source for --stream-fifo --stream-follow --stream-socket */
+#define VI_SOURCE_FIFO 0
+#define VI_SOURCE_FOLLOW 1
+#define VI_SOURCE_SOCKET 2
+struct streamsrc {
+	int type;
+	char *path;
+};
+
 /* ---------------------- global configuration parameters ------------------- */
 int Config_debug = 0;
 int Config_max_referers = 20;
@@ -170,9 +265,25 @@ int Config_stream_mode = 0;
 int Config_update_every = 60*10; /* update every 10 minutes for default. */
 int Config_reset_every = 0;	/* never reset for default */
 int Config_time_delta = 0;	/* adjustable time difference */
+int Config_display_fixed = 0;	/* display zone is a fixed offset */
+int Config_display_offset = 0;	/* its offset from UTC in seconds */
 int Config_filter_spam = 0;
 int Config_ignore_404 = 0;
+int Config_threads = 1;		/* threads used to process the logs */
+int Config_io_uring = 0;	/* read the log files with io_uring */
+int Config_merge = 0;		/* process the lines of all the files in
+				   time order, see --merge */
+time_t Config_from = 0;		/* see --from, 0 if not set */
+time_t Config_to = 0;		/* see --to, 0 if not set */
 char *Config_output_file = NULL; /* stdout if not set. */
+char *Config_state_file = NULL;	/* see --state */
+char *Config_log_format_string = NULL; /* see --log-format */
+struct vi_logformat *Config_log_format = NULL; /* compiled, NULL for the
+						  default parser */
+int Config_log_format_auto = 0;	/* detect the format of every input, see
+				   --log-format auto */
+unsigned int Config_fields = ~0U; /* fields to parse, see vi_needed_fields() */
+struct vi_state *State = NULL;	/* loaded from Config_state_file */
 struct outputmodule *Output = NULL; /* intialized to 'text' in main() */
 
 /* Prefixes */
@@ -183,6 +294,10 @@ struct vistring Config_prefix[VI_PREFIXES_MAX];
 struct greppat Config_grep_pattern[VI_GREP_PATTERNS_MAX];
 int Config_grep_pattern_num = 0;    /* number of set patterns */
 
+/* Stream mode sources, other than stdin */
+struct streamsrc Config_stream_source[VI_STREAM_SOURCES_MAX];
+int Config_stream_source_num = 0;
+
 /*----------------------------------- Tables ---------------------------------*/
 static char *vi_wdname[7] = {"Mo", "Tu", "We", "Th", "Fr", "Sa", "Su"};
 #if 0
@@ -191,6 +306,10 @@ static int vi_monthdays[12] = {31, 29, 31, 30, 31, 30 , 31, 31, 30, 31, 30, 31};
 
 /* -------------------------------- prototypes ------------------------------ */
 void vi_clear_error(struct vih *vih);
+void vi_free_visits(struct vih *vih);
+int vi_merge(struct vih *dst, struct vih *src);
+off_t vi_state_offset(struct stat *sb, int compressed);
+void vi_state_end(char *filename, struct stat *sb, off_t offset);
 void vi_tail(int filec, char **filev);
 
 /*------------------- Options parsing help functions ------------------------ */
@@ -213,6 +332,18 @@ void ConfigAddGrepPattern(char *pattern, int type)
     Config_grep_pattern_num++;
 }
 
+void ConfigAddStreamSource(char *path, int type)
+{
+	if (Config_stream_source_num == VI_STREAM_SOURCES_MAX) {
+		fprintf(stderr, "Too many stream sources specified\n");
+		exit(1);
+	}
+	Config_stream_source[Config_stream_source_num].type = type;
+	Config_stream_source[Config_stream_source_num].path = path;
+	Config_stream_source_num++;
+	Config_stream_mode = 1;
+}
+
 /*------------------------------ support functions -------------------------- */
 /* Returns non-zero if the link seems like a google link, zero otherwise.
  * Note that this function only checks for a prefix of www.google.<something>.
@@ -362,68 +493,143 @@ int vi_is_numeric_address(char *ip)
 	return strspn(ip, "0123456789.") == l;
 }
 
-/* returns the time converted into a time_t value.
- * On error (time_t) -1 is returned.
- * Note that this function is specific for the following format:
- * "10/May/2004:04:15:33". Works if the month is not an abbreviation, or if the
- * year is abbreviated to only the last two digits.
- * The time can be omitted like in "10/May/2004". */
-time_t parse_date(char *s, struct tm *tmptr)
+/* Dates are converted to UTC using the zone of the log, like "+0200"
+ * after the time: the time of a day is just arithmetic, without libc
+ * calls. Dates without a zone, like the ones of --from and --to, are in
+ * the display zone. The broken-down time used for the reports is in the
+ * display zone, see --display-zone: with a fixed offset, like UTC, this
+ * is arithmetic too, otherwise it is the local time of the host (or of
+ * the zone named with --display-zone).
+ *
+ * parse_date() is called for every line, and log files hold many lines
+ * for every second and day, in order. So the result for the last string
+ * is cached, and so are the last day, the last zone and the last local
+ * day of the results: their offset from UTC is the same for the whole
+ * day, so localtime_r() is called about once per day.
+ *
+ * Days with a daylight saving time change are not 86400 seconds long:
+ * for them the libc functions are called every time.
+ *
+ * The worker threads call parse_date() too, so every thread has its own
+ * cache. */
+struct vi_date_cache {
+	/* Last string parsed */
+	int secok;
+	int seclen;
+	char sec[32];
+	time_t t;
+	struct tm tm;
+	/* Last day parsed, like "10/May/2004" */
+	int dayok;
+	int daylen;
+	char day[32];
+	struct tm daytm;	/* fields of the day, for mktime() */
+	time_t utcday;		/* its midnight in UTC */
+	int localok;		/* the two fields below are set */
+	time_t midnight;	/* its midnight in the local zone */
+	int regular;		/* the local day is 86400 seconds long */
+	/* Last zone parsed, like "+0200" */
+	char zone[5];
+	int zoneoff;		/* offset from UTC in seconds */
+	/* Last local day in the results of parse_date() */
+	int resultok;
+	time_t resultday;	/* its midnight */
+	struct tm resulttm;	/* localtime of its midnight */
+};
+
+#ifdef VI_HAVE_PTHREADS
+static __thread struct vi_date_cache vi_date_cache;
+#else
+static struct vi_date_cache vi_date_cache;
+#endif
+
+/* Return the number of days since 1 Jan 1970 of the given date of the
+ * proleptic Gregorian calendar. 'mon' is 0-11, 'mday' may be out of the
+ * month, like for mktime(). */
+static long vi_days_from_civil(long year, int mon, int mday)
+{
+	long era, yoe, doy, doe;
+
+	mon++;
+	year -= mon <= 2;
+	era = (year >= 0 ? year : year-399) / 400;
+	yoe = year - era*400;
+	doy = (153*(mon + (mon > 2 ? -3 : 9)) + 2)/5 + mday-1;
+	doe = yoe*365 + yoe/4 - yoe/100 + doy;
+	return era*146097 + doe - 719468;
+}
+
+/* Like gmtime_r(), without the libc. */
+static void vi_gmtime(time_t t, struct tm *tm)
+{
+	long days = t/86400, secs = t%86400, era, doe, yoe, doy, mp, year;
+
+	if (secs < 0) {
+		secs += 86400;
+		days--;
+	}
+	memset(tm, 0, sizeof(*tm));
+	tm->tm_hour = secs/3600;
+	tm->tm_min = (secs/60)%60;
+	tm->tm_sec = secs%60;
+	tm->tm_wday = ((days%7)+11)%7;	/* 1 Jan 1970 was Thursday */
+	days += 719468;
+	era = (days >= 0 ? days : days-146096) / 146097;
+	doe = days - era*146097;
+	yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+	doy = doe - (365*yoe + yoe/4 - yoe/100);
+	mp = (5*doy + 2)/153;
+	year = yoe + era*400 + (mp >= 10);
+	tm->tm_mday = doy - (153*mp+2)/5 + 1;
+	tm->tm_mon = mp < 10 ? mp+2 : mp-10;
+	tm->tm_year = year-1900;
+	tm->tm_yday = days-719468 - vi_days_from_civil(year, 0, 1);
+}
+
+/* Parse the day 's' of length 'len', like "10/May/2004", into the
+ * cache. Returns -1 on format error. */
+static int vi_parse_day(struct vi_date_cache *c, char *s, int len)
 {
 	struct tm tm;
-	time_t t;
 	char *months[] = {
 		"jan", "feb", "mar", "apr", "may", "jun",
 		"jul", "aug", "sep", "oct", "nov", "dec",
 	};
-	char *day, *month, *year, *time = NULL;
+	char *day, *month, *year;
 	char monthaux[32];
-	int i, len;
+	int i;
 
 	/* make a copy to mess with it */
-	len = strlen(s);
-	if (len >= 32) goto fmterr;
 	memcpy(monthaux, s, len);
 	monthaux[len] = '\0';
 
 	/* Inizialize the tm structure. We just fill three fields */
-	tm.tm_sec = 0;
-	tm.tm_min = 0;
-	tm.tm_hour = 0;
-	tm.tm_mday = 0;
-	tm.tm_mon = 0;
-	tm.tm_year = 0;
-	tm.tm_wday = 0;
-	tm.tm_yday = 0;
+	memset(&tm, 0, sizeof(tm));
 	tm.tm_isdst = -1;
 
 	/* search delimiters */
 	day = monthaux;
-	if ((month = strchr(day, '/')) == NULL) goto fmterr;
+	if ((month = strchr(day, '/')) == NULL) return -1;
 	*month++ = '\0';
-	if ((year = strchr(month, '/')) == NULL) goto fmterr;
+	if ((year = strchr(month, '/')) == NULL) return -1;
 	*year++ = '\0';
-	/* time, optional for this parser. */
-	if ((time = strchr(year, ':')) != NULL) {
-		*time++ = '\0';
-	}
 	/* convert day */
 	tm.tm_mday = atoi(day);
-	if (tm.tm_mday < 1 || tm.tm_mday > 31) goto fmterr;
+	if (tm.tm_mday < 1 || tm.tm_mday > 31) return -1;
 	/* convert month */
-	if (strlen(month) < 3) goto fmterr;
+	if (strlen(month) < 3) return -1;
 	month[0] = tolower(month[0]);
 	month[1] = tolower(month[1]);
 	month[2] = tolower(month[2]);
 	for (i = 0; i < 12; i++) {
 		if (memcmp(month, months[i], 3) == 0) break;
 	}
-	if (i == 12) goto fmterr;
+	if (i == 12) return -1;
 	tm.tm_mon = i;
 	/* convert year */
 	tm.tm_year = atoi(year);
 	if (tm.tm_year > 100) {
-		if (tm.tm_year < 1900 || tm.tm_year > 2500) goto fmterr;
+		if (tm.tm_year < 1900 || tm.tm_year > 2500) return -1;
 		tm.tm_year -= 1900;
 	} else {
 		/* if the year is in two-digits form, the 0 - 68 range
@@ -431,31 +637,202 @@ time_t parse_date(char *s, struct tm *tmptr)
 		if (tm.tm_year < 69)
 			tm.tm_year += 100;
 	}
+	c->daytm = tm;
+	c->utcday = (time_t)vi_days_from_civil(tm.tm_year+1900, tm.tm_mon,
+		tm.tm_mday)*86400;
+	c->localok = 0;
+	memcpy(c->day, s, len);
+	c->daylen = len;
+	c->dayok = 1;
+	return 0;
+}
+
+/* Compute the local midnight of the cached day. Returns -1 on error. */
+static int vi_local_day(struct vi_date_cache *c)
+{
+	struct tm tm = c->daytm;
+	time_t next;
+
+	if ((c->midnight = mktime(&tm)) == (time_t)-1) return -1;
+	tm = c->daytm;
+	tm.tm_mday++;
+	next = mktime(&tm);
+	c->regular = next != (time_t)-1 && next - c->midnight == 86400;
+	c->localok = 1;
+	return 0;
+}
+
+/* Parse a zone like "+0200" into the cache. Returns -1 if 's' is not a
+ * zone. */
+static int vi_parse_zone(struct vi_date_cache *c, char *s)
+{
+	int i;
+
+	if (memcmp(s, c->zone, 5) == 0) return 0;
+	if (s[0] != '+' && s[0] != '-') return -1;
+	for (i = 1; i < 5; i++)
+		if (!isdigit((unsigned char)s[i])) return -1;
+	c->zoneoff = ((s[1]-'0')*10+(s[2]-'0'))*3600 +
+		((s[3]-'0')*10+(s[4]-'0'))*60;
+	if (s[0] == '-') c->zoneoff = -c->zoneoff;
+	memcpy(c->zone, s, 5);
+	return 0;
+}
+
+/* Like localtime_r() in the display zone, using the cached local day
+ * when 't' is inside it. */
+static void vi_date_localtime(struct vi_date_cache *c, time_t t,
+		struct tm *tmptr)
+{
+	struct tm auxtm, endtm;
+	time_t secs;
+
+	if (Config_display_fixed) {
+		vi_gmtime(t+Config_display_offset, tmptr);
+		return;
+	}
+	if (c->resultok && t >= c->resultday && t - c->resultday < 86400) {
+		secs = t - c->resultday;
+		*tmptr = c->resulttm;
+		tmptr->tm_hour = secs/3600;
+		tmptr->tm_min = (secs/60)%60;
+		tmptr->tm_sec = secs%60;
+		return;
+	}
+	if (localtime_r(&t, &auxtm) == NULL) return;
+	*tmptr = auxtm;
+	/* Cache the day only if it is 86400 seconds long. */
+	c->resultday = t - (auxtm.tm_hour*3600+auxtm.tm_min*60+auxtm.tm_sec);
+	c->resultok = 0;
+	secs = c->resultday+86399;
+	if (localtime_r(&secs, &endtm) == NULL ||
+	    endtm.tm_mday != auxtm.tm_mday || endtm.tm_hour != 23 ||
+	    endtm.tm_min != 59 || endtm.tm_sec != 59 ||
+	    endtm.tm_isdst != auxtm.tm_isdst)
+		return;
+	c->resulttm = auxtm;
+	c->resulttm.tm_hour = c->resulttm.tm_min = c->resulttm.tm_sec = 0;
+	c->resultok = 1;
+}
+
+/* Convert 't' to the broken-down time in the display zone. */
+void vi_display_time(time_t t, struct tm *tm)
+{
+	memset(tm, 0, sizeof(*tm));
+	vi_date_localtime(&vi_date_cache, t, tm);
+}
+
+/* returns the time converted into a time_t value.
+ * On error (time_t) -1 is returned.
+ * Note that this function is specific for the following format:
+ * "10/May/2004:04:15:33 +0200". Works if the month is not an abbreviation,
+ * or if the year is abbreviated to only the last two digits.
+ * The time can be omitted like in "10/May/2004", and so can be the zone:
+ * in this case the date is in the display zone. */
+time_t parse_date(char *s, struct tm *tmptr)
+{
+	struct vi_date_cache *c = &vi_date_cache;
+	struct tm tm;
+	time_t t;
+	char *time, *zone = NULL;
+	int len, daylen, secs = 0, hour, min, sec;
+
+	len = strlen(s);
+	if (len >= 32) goto fmterr;
+	/* Same string of the last call? */
+	if (c->secok && len == c->seclen && memcmp(s, c->sec, len) == 0) {
+		if (tmptr) *tmptr = c->tm;
+		return c->t;
+	}
+	/* time, optional for this parser. */
+	if ((time = memchr(s, ':', len)) != NULL) {
+		daylen = time-s;
+		time++;
+	} else {
+		daylen = len;
+	}
+	/* convert day */
+	if (!c->dayok || daylen != c->daylen ||
+	    memcmp(s, c->day, daylen) != 0)
+	{
+		c->dayok = 0;
+		if (vi_parse_day(c, s, daylen) == -1) goto fmterr;
+	}
 	/* convert time */
 	if (time) { /* format is HH:MM:SS */
-		if (strlen(time) < 8) goto fmterr;
-		tm.tm_hour = ((time[0]-'0')*10)+(time[1]-'0');
-		if (tm.tm_hour < 0 || tm.tm_hour > 23) goto fmterr;
-		tm.tm_min = ((time[3]-'0')*10)+(time[4]-'0');
-		if (tm.tm_min < 0 || tm.tm_min > 59) goto fmterr;
-		tm.tm_sec = ((time[6]-'0')*10)+(time[7]-'0');
-		if (tm.tm_sec < 0 || tm.tm_sec > 60) goto fmterr;
-	}
-	t = mktime(&tm);
-	if (t == (time_t)-1) goto fmterr;
-	t += (Config_time_delta*3600);
-	if (tmptr) {
-		struct tm *auxtm;
-
-		if ((auxtm = localtime(&t)) != NULL)
-			*tmptr = *auxtm;
+		if (len-(time-s) < 8) goto fmterr;
+		hour = ((time[0]-'0')*10)+(time[1]-'0');
+		if (hour < 0 || hour > 23) goto fmterr;
+		min = ((time[3]-'0')*10)+(time[4]-'0');
+		if (min < 0 || min > 59) goto fmterr;
+		sec = ((time[6]-'0')*10)+(time[7]-'0');
+		if (sec < 0 || sec > 60) goto fmterr;
+		secs = hour*3600 + min*60 + sec;
+		/* zone, optional too */
+		for (zone = time+8; *zone == ' '; zone++);
+		if (s+len-zone < 5 || vi_parse_zone(c, zone) == -1)
+			zone = NULL;
+	}
+	if (zone) {
+		t = c->utcday + secs - c->zoneoff;
+	} else if (Config_display_fixed) {
+		t = c->utcday + secs - Config_display_offset;
+	} else {
+		if (!c->localok && vi_local_day(c) == -1) goto fmterr;
+		if (c->regular) {
+			t = c->midnight + secs;
+		} else {
+			tm = c->daytm;
+			tm.tm_sec = secs;
+			t = mktime(&tm);
+			if (t == (time_t)-1) goto fmterr;
+		}
 	}
+	t += (Config_time_delta*3600);
+	c->secok = 0;
+	vi_date_localtime(c, t, &c->tm);
+	c->t = t;
+	memcpy(c->sec, s, len);
+	c->seclen = len;
+	c->secok = 1;
+	if (tmptr) *tmptr = c->tm;
 	return t;
 
 fmterr: /* format error */
 	return (time_t) -1;
 }
 
+/* Set the zone of the reports, see --display-zone: "local" for the zone
+ * of the host, "UTC", an offset like "+0200", or the name of a zone like
+ * "Europe/Rome". Returns non-zero if the zone is not valid. */
+int vi_set_display_zone(char *zone)
+{
+	struct vi_date_cache c;
+	char *env;
+
+	Config_display_fixed = 0;
+	Config_display_offset = 0;
+	if (!strcasecmp(zone, "local")) return 0;
+	if (!strcasecmp(zone, "UTC") || !strcasecmp(zone, "GMT")) {
+		Config_display_fixed = 1;
+		return 0;
+	}
+	if (zone[0] == '+' || zone[0] == '-') {
+		memset(&c, 0, sizeof(c));
+		if (strlen(zone) != 5 || vi_parse_zone(&c, zone) == -1)
+			return 1;
+		Config_display_fixed = 1;
+		Config_display_offset = c.zoneoff;
+		return 0;
+	}
+	/* A zone name: the local time is computed by the libc for it. */
+	if ((env = malloc(strlen(zone)+4)) == NULL) return 1;
+	sprintf(env, "TZ=%s", zone);
+	putenv(env);
+	tzset();
+	return 0;
+}
+
 /* returns 1 if the given date is Saturday or Sunday.
  * Zero is otherwise returned. */
 int vi_is_weekend(char *s)
@@ -858,6 +1235,10 @@ struct vih *vi_new(void)
 	vih->invalid = 0;
         vih->blacklisted = 0;
 	vi_reset_combined_maps(vih);
+	vih->threads = Config_threads;
+	vih->defer = 0;
+	vih->seen = 1;
+	vih->visits = vih->visits_tail = NULL;
 	vih->error = NULL;
 	vi_ht_init(&vih->visitors);
 	vi_ht_init(&vih->googlevisitors);
@@ -894,6 +1275,7 @@ void vi_free(struct vih *vih)
 {
 	if (!vih) return;
 	vi_reset_hashtables(vih);
+	vi_free_visits(vih);
 	vi_clear_error(vih);
 	free(vih);
 }
@@ -1052,14 +1434,59 @@ void vi_clear_error(struct vih *vih)
 }
 
 /*----------------------------------- parsing   ----------------------------- */
-/* Parse a line of log, and fill the logline structure with
- * appropriate values. On error (bad line format) non-zero is returned. */
-int vi_parse_line(struct logline *ll, char *l)
+/* Return the fields of the log lines needed by the enabled reports, as
+ * VI_FIELD_BIT() bits, so that the parsers can skip the others. */
+unsigned int vi_needed_fields(void)
+{
+	/* Unique visitors, pages and referers are always reported: the
+	 * visits are identified by host, date and agent, and the bots,
+	 * found by the agent, are never counted as visitors, whatever
+	 * reports are enabled. Google visits are found by the referer. */
+	unsigned int mask = VI_FIELD_BIT(VI_FIELD_HOST) |
+		VI_FIELD_BIT(VI_FIELD_DATE) | VI_FIELD_BIT(VI_FIELD_TIME) |
+		VI_FIELD_BIT(VI_FIELD_REQUEST) | VI_FIELD_BIT(VI_FIELD_REFERER) |
+		VI_FIELD_BIT(VI_FIELD_AGENT);
+
+	/* 404 errors, and with them --ignore-404 and --screen-info */
+	if (Config_process_error404) mask |= VI_FIELD_BIT(VI_FIELD_STATUS);
+	return mask;
+}
+
+/* Parse the status code and the size of the response that follow the
+ * request in the Common Log Format, like in '" 200 2326', at 'p'.
+ * The line is not modified. */
+void vi_parse_status(struct logline *ll, char *p)
+{
+	int status = 0;
+	long bytes = 0;
+
+	while(*p == ' ') p++;
+	if (*p < '0' || *p > '9') return;
+	while(*p >= '0' && *p <= '9') status = status*10 + (*p++ - '0');
+	if (*p != ' ' && *p != '\0') return;
+	ll->status = status;
+	while(*p == ' ') p++;
+	if (*p == '-') {
+		ll->bytes = 0;
+		return;
+	}
+	if (*p < '0' || *p > '9') return;
+	while(*p >= '0' && *p <= '9') bytes = bytes*10 + (*p++ - '0');
+	ll->bytes = bytes;
+}
+
+/* Parse a line of log without --log-format, guessing where the components
+ * are, and fill the logline structure with appropriate values. On error
+ * (bad line format) non-zero is returned. */
+int vi_parse_line_default(struct logline *ll, char *l)
 {
 	char *date, *hour, *timezone, *host, *agent, *req, *ref, *p;
 	char *agent_start = NULL, *req_end = NULL, *ref_end = NULL;
         int agent_without_parens = 0;
 
+	ll->status = 0;
+	ll->bytes = ll->duration = -1;
+
 	/* Seek the start of the different components */
 
 	/* host */
@@ -1158,6 +1585,9 @@ int vi_parse_line(struct logline *ll, char *l)
 		req = "";
 	} else {
 		req_end = p;
+		if (Config_fields & (VI_FIELD_BIT(VI_FIELD_STATUS) |
+				     VI_FIELD_BIT(VI_FIELD_BYTES)))
+			vi_parse_status(ll, p+1);
 		*p = '\0';
 		if ((p = strchr(req, ' ')) != NULL) {
 			req = p+1;
@@ -1213,6 +1643,252 @@ int vi_parse_line(struct logline *ll, char *l)
 	return 0;
 }
 
+/* The log format of the input parsed by this thread with --log-format
+ * auto, see vi_select_format(). */
+#ifdef VI_HAVE_PTHREADS
+static __thread struct vi_logformat *Log_format;
+#else
+static struct vi_logformat *Log_format;
+#endif
+
+/* The log format to parse the lines with, NULL for the default parser. */
+#define vi_log_format() (Config_log_format_auto ? Log_format : \
+	Config_log_format)
+
+/* Fill the logline structure with the fields of a line split by the log
+ * format 'lf', indexed by VI_FIELD_*. Returns non-zero on error like
+ * vi_parse_line(). */
+int vi_parse_fields(struct logline *ll, struct vi_logformat *lf,
+		char **field)
+{
+	char *p;
+
+	/* Unused fields are empty, see vi_logformat_mask(). */
+	ll->status = atoi(field[VI_FIELD_STATUS]);
+	ll->bytes = -1;
+	if (field[VI_FIELD_BYTES][0] == '-')
+		ll->bytes = 0;
+	else if (isdigit((unsigned char)field[VI_FIELD_BYTES][0]))
+		ll->bytes = atol(field[VI_FIELD_BYTES]);
+	/* The duration, in the unit of the format */
+	ll->duration = -1;
+	if (isdigit((unsigned char)field[VI_FIELD_DURATION][0])) {
+		if (lf->duration_unit)
+			ll->duration = atol(field[VI_FIELD_DURATION])*
+				lf->duration_unit;
+		else
+			ll->duration = atof(field[VI_FIELD_DURATION])*1000000;
+	}
+	ll->host = field[VI_FIELD_HOST];
+	if (ll->host[0] == '\0') return 1;
+	/* date, hour and timezone */
+	if (field[VI_FIELD_TIME][0]) {
+		/* Date and time in their own fields, in UTC */
+		char date[VI_DATE_MAX];
+
+		ll->date = field[VI_FIELD_DATE];
+		ll->hour = field[VI_FIELD_TIME];
+		ll->timezone = "+0000";
+		snprintf(date, sizeof(date), "%s:%s +0000", ll->date, ll->hour);
+		ll->time = parse_date(date, &ll->tm);
+		if (ll->time == (time_t)-1) return 1;
+		goto req;
+	}
+	ll->date = field[VI_FIELD_DATE];
+	ll->time = parse_date(ll->date, &ll->tm);
+	if (ll->time == (time_t)-1) return 1;
+	if ((p = strchr(ll->date, ':')) == NULL) return 1;
+	ll->hour = p+1;
+	*p = '\0';
+	ll->timezone = "";
+	if ((p = strchr(ll->hour, ' ')) != NULL) {
+		ll->timezone = p+1;
+		*p = '\0';
+	}
+req:
+	/* req: the URL between the method and the protocol */
+	ll->req = field[VI_FIELD_REQUEST];
+	if ((p = strchr(ll->req, ' ')) != NULL) {
+		ll->req = p+1;
+		if ((p = strchr(ll->req, ' ')) != NULL)
+			*p = '\0';
+	}
+	/* ref */
+	ll->ref = field[VI_FIELD_REFERER];
+	if (ll->ref[0] == '-' && ll->ref[1] == '\0') ll->ref = "";
+	/* agent */
+	ll->agent = field[VI_FIELD_AGENT];
+	return 0;
+}
+
+/* Parse a line of log with the format of --log-format. Returns -1 if the
+ * line is not a log entry, like the directives of W3C logs. */
+int vi_parse_line_format(struct logline *ll, char *l)
+{
+	struct vi_logformat *lf = vi_log_format();
+	char *field[VI_FIELDS];
+	int retval = vi_logformat_split(lf, l, field);
+
+	if (retval == 1) return -1;
+	if (retval == -1) return 1;
+	return vi_parse_fields(ll, lf, field);
+}
+
+/* Formats tried by --log-format auto, from the more specific: the common
+ * format matches the lines of the combined one as well, ignoring the end
+ * of the line. */
+static struct {
+	char *name;
+	struct vi_logformat *lf;
+} Auto_format[] = {
+	{"vhost_combined", NULL},
+	{"combined", NULL},
+	{"common", NULL},
+	{"json", NULL},
+	{"w3c", NULL},
+	{NULL, NULL}
+};
+
+/* Lines of every input sampled by vi_detect_format(), and bytes read to
+ * sample them when the input is not in memory. */
+#define VI_DETECT_LINES 200
+#define VI_DETECT_SAMPLE (64*1024)
+
+/* Compile the formats of --log-format auto. Returns non-zero on error. */
+int vi_auto_init(void)
+{
+	char err[128];
+	int j;
+
+	for (j = 0; Auto_format[j].name; j++) {
+		if ((Auto_format[j].lf = vi_logformat_compile(Auto_format[j].name,
+				err, sizeof(err))) == NULL) return 1;
+	}
+	return 0;
+}
+
+/* Parse just the fields in 'mask' with the formats of --log-format auto. */
+void vi_auto_mask(unsigned int mask)
+{
+	int j;
+
+	for (j = 0; Auto_format[j].name; j++)
+		vi_logformat_mask(Auto_format[j].lf, mask);
+}
+
+/* Return the format of the log starting with the 'len' bytes at 'buf',
+ * trying the formats of Auto_format on the first lines, or NULL for the
+ * default parser. The first format parsing some of the lines is selected
+ * if it parses all of them: otherwise the log mixes formats, like Common
+ * and Combined lines, or has invalid lines, that only the default parser
+ * handles without to lose entries. The name of the format is stored at
+ * 'name'. */
+struct vi_logformat *vi_detect_format(char *buf, long len, char **name)
+{
+	struct vi_w3c_columns cols;
+	int j, ok = 0, total = 0;
+
+	*name = "default";
+	for (j = 0; Auto_format[j].name; j++) {
+		struct vi_logformat *lf = Auto_format[j].lf;
+		char *p = buf, *end = buf+len, *nl;
+		int lines = 0;
+
+		/* The W3C columns of the sample are not the ones of the
+		 * thread. */
+		cols.cols = 0;
+		vi_logformat_columns(&cols);
+		while(p < end && lines < VI_DETECT_LINES) {
+			char line[VI_LINE_MAX], *field[VI_FIELDS];
+			struct logline ll;
+			long l;
+			int ret;
+
+			/* The last line of a sample may be truncated. */
+			if ((nl = memchr(p, '\n', end-p)) == NULL) break;
+			l = nl-p;
+			if (l && p[l-1] == '\r') l--;
+			if (l > 0 && l < VI_LINE_MAX) {
+				memcpy(line, p, l);
+				line[l] = '\0';
+				lines++;
+				ret = vi_logformat_split(lf, line, field);
+				if (ret != 1) total++;
+				if (ret == 0 && vi_parse_fields(&ll, lf, field) == 0)
+					ok++;
+			}
+			p = nl+1;
+		}
+		if (ok) break;
+		total = 0;
+	}
+	vi_logformat_columns(NULL);
+	if (ok == 0 || ok != total) return NULL;
+	*name = Auto_format[j].name;
+	return Auto_format[j].lf;
+}
+
+/* With --log-format auto, detect the format of the input 'filename'
+ * starting with the 'len' bytes at 'buf', and use it for the lines parsed
+ * by this thread. The format is returned, and reported with --debug. */
+struct vi_logformat *vi_select_format(char *filename, char *buf, long len)
+{
+	char *name;
+
+	if (!Config_log_format_auto) return Config_log_format;
+	Log_format = vi_detect_format(buf, len, &name);
+	vi_logformat_seek(Log_format, NULL, 0, 0);
+	if (Config_debug)
+		fprintf(stderr, "%s: %s log format\n",
+			filename ? filename : "stdin", name);
+	return Log_format;
+}
+
+/* Parse a line of log, and fill the logline structure with
+ * appropriate values. On error (bad line format) non-zero is returned:
+ * -1 if the line is not a log entry at all, see vi_parse_line_format(). */
+int vi_parse_line(struct logline *ll, char *l)
+{
+	if (vi_log_format()) return vi_parse_line_format(ll, l);
+	return vi_parse_line_default(ll, l);
+}
+
+/* Return the time of the log line of 'len' bytes at 'l', looking just at
+ * the date between brackets (splitting a copy of the line with
+ * --log-format), or (time_t)-1 if it can't be found.
+ * The line is not modified, and does not need to be nul terminated. */
+time_t vi_line_time(char *l, long len)
+{
+	char date[VI_DATE_MAX], *start, *end;
+
+	if (vi_log_format()) {
+		struct vi_logformat *lf = vi_log_format();
+		char line[VI_LINE_MAX], *field[VI_FIELDS];
+
+		if (len >= VI_LINE_MAX) return (time_t)-1;
+		/* The W3C directives have no time, and are not split here
+		 * to leave the columns as they are: they are loaded only
+		 * when the line is processed. */
+		if (lf->w3c && len && l[0] == '#') return (time_t)-1;
+		memcpy(line, l, len);
+		line[len] = '\0';
+		if (vi_logformat_split(lf, line, field)) return (time_t)-1;
+		if (field[VI_FIELD_TIME][0]) {
+			snprintf(date, sizeof(date), "%s:%s +0000",
+				field[VI_FIELD_DATE], field[VI_FIELD_TIME]);
+			return parse_date(date, NULL);
+		}
+		return parse_date(field[VI_FIELD_DATE], NULL);
+	}
+	if ((start = memchr(l, '[', len)) == NULL) return (time_t)-1;
+	start++;
+	if ((end = memchr(start, ']', len-(start-l))) == NULL ||
+	    end-start >= VI_DATE_MAX) return (time_t)-1;
+	memcpy(date, start, end-start);
+	date[end-start] = '\0';
+	return parse_date(date, NULL);
+}
+
 /* process the weekday and hour information */
 void vi_process_date_and_hour(struct vih *vih, int weekday, int hour)
 {
@@ -1232,24 +1908,82 @@ void vi_process_month_and_day(struct vih *vih, int month, int day)
 	vih->monthday[month][day]++;
 }
 
+/* Append a new visit to the list of deferred visits of the handle,
+ * see vi_merge(). The line fields are NULL for google visits.
+ * Return non-zero on out of memory. */
+int vi_defer_visit(struct vih *vih, int google, char *key, char *date,
+	char *host, char *agent, char *ref, char *req, time_t time,
+	struct tm *tm)
+{
+	struct vi_visit *v;
+	char *strv[6] = {key, date, host, agent, ref, req};
+	char **dstv[6];
+	size_t len = 0, l;
+	char *p;
+	int j;
+
+	for (j = 0; j < 6; j++)
+		if (strv[j]) len += strlen(strv[j])+1;
+	/* The strings are stored in the same allocation. */
+	if ((v = malloc(sizeof(*v)+len)) == NULL) return 1;
+	dstv[0] = &v->key; dstv[1] = &v->date; dstv[2] = &v->host;
+	dstv[3] = &v->agent; dstv[4] = &v->ref; dstv[5] = &v->req;
+	p = (char*) (v+1);
+	for (j = 0; j < 6; j++) {
+		if (strv[j] == NULL) {
+			*dstv[j] = NULL;
+			continue;
+		}
+		l = strlen(strv[j])+1;
+		memcpy(p, strv[j], l);
+		*dstv[j] = p;
+		p += l;
+	}
+	v->next = NULL;
+	v->google = google;
+	v->time = time;
+	if (tm) v->tm = *tm;
+	if (vih->visits_tail) vih->visits_tail->next = v;
+	else vih->visits = v;
+	vih->visits_tail = v;
+	return 0;
+}
+
+/* Release the deferred visits of the handle. */
+void vi_free_visits(struct vih *vih)
+{
+	struct vi_visit *v = vih->visits;
+
+	while(v) {
+		struct vi_visit *next = v->next;
+		free(v);
+		v = next;
+	}
+	vih->visits = vih->visits_tail = NULL;
+}
+
 /* Process unique visitors populating the relative hash table.
  * Return non-zero on out of memory. This is also used to populate
  * the hashtable used for the "pageviews per user" statistics.
  *
  * Note that the last argument 'seen', is an integer passed by reference
- * that is set to '1' if this is not a new visit (otherwise it's set to zero) */
-int vi_process_visitors_per_day(struct vih *vih, char *host, char *agent, char *date, char *ref, char *req, int *seen)
-{
-	char visday[VI_LINE_MAX], *p, *month = "fixme if I'm here!";
+ * that is set to '1' if this is not a new visit (otherwise it's set to zero).
+ * Lines from bots and the ones that are not tracked leave it untouched,
+ * so they share the state of the line processed before them.
+ * The identifier of the visit is stored at 'visday', that has room for
+ * VI_LINE_MAX bytes: it is left empty for visits that are not tracked,
+ * like the ones from bots. */
+int vi_process_visitors_per_day(struct vih *vih, char *host, char *agent, char *date, char *ref, char *req, char *visday, int *seen)
+{
+	char *p, *month = "fixme if I'm here!";
         char buf[64];
 	int res, host_len, agent_len, date_len, hash_len;
         unsigned long h;
 
+	visday[0] = '\0';
         /* Ignore visits from Bots */
-        if (vi_is_bot_agent(agent)) {
-            if (seen != NULL) seen = 0;
+        if (vi_is_bot_agent(agent))
             return 0;
-        }
 
         /* Build an unique identifier for this visit
          * adding together host, date and hash(user agent) */
@@ -1282,7 +2016,10 @@ int vi_process_visitors_per_day(struct vih *vih, char *host, char *agent, char *
 	if (vi_is_google_link(ref)) {
 		res = vi_counter_incr(&vih->googlevisitors, visday);
 		if (res == 0) return 1; /* out of memory */
-		if (res == 1) { /* new visit! */
+		if (res == 1 && vih->defer) {
+			if (vi_defer_visit(vih, 1, visday, date, NULL, NULL,
+					NULL, NULL, 0, NULL)) return 1;
+		} else if (res == 1) { /* new visit! */
 			res = vi_counter_incr(&vih->googledate, date);
 			if (res == 0) return 1; /* out of memory */
 			if (Config_process_monthly_visitors) {
@@ -1304,6 +2041,9 @@ int vi_process_visitors_per_day(struct vih *vih, char *host, char *agent, char *
 		return 0; /* visit alredy seen. */
 	}
 	if (seen) *seen = 0; /* new visitor */
+	/* When deferred the caller will add the visit to the list together
+	 * with the line fields. */
+	if (vih->defer) return 0;
 	res = vi_counter_incr(&vih->date, date);
 	if (res == 0) return 1;
 	if (Config_process_monthly_visitors) {
@@ -1355,18 +2095,13 @@ int vi_process_page_request(struct vih *vih, char *url)
 	return 0;
 }
 
-/* Process log lines for 404 errors report. */
-int vi_process_error404(struct vih *vih, char *l, char *url, int *is404)
+/* Process the URL of a 404 error for the 404 errors report. */
+int vi_process_error404(struct vih *vih, char *url)
 {
 	char urldecoded[VI_LINE_MAX];
 
-        if (is404) *is404 = 0;
 	vi_urldecode(urldecoded, url, VI_LINE_MAX);
-	if (strstr(l, " 404 ") && !strstr(l, " 200 ")) {
-                if (is404) *is404 = 1;
-		return !vi_counter_incr(&vih->error404, urldecoded);
-        }
-	return 0;
+	return !vi_counter_incr(&vih->error404, urldecoded);
 }
 
 /* Process agents populating the relative hash table.
@@ -1631,6 +2366,27 @@ int vi_process_tld(struct vih *vih, char *hostname)
 	return 0;
 }
 
+/* Process the reports generated only for the first line of every visit.
+ * Return non-zero on out of memory. */
+int vi_process_new_visit(struct vih *vih, char *host, char *agent,
+	char *ref, char *req, time_t time, struct tm *tm)
+{
+	vi_process_date_and_hour(vih, (tm->tm_wday+6)%7, tm->tm_hour);
+	vi_process_month_and_day(vih, tm->tm_mon, tm->tm_mday-1);
+	if (vi_process_referer(vih, ref, time)) return 1;
+	if (Config_process_agents &&
+	    vi_process_agents(vih, agent)) return 1;
+	if (Config_process_os &&
+	    vi_process_os(vih, agent)) return 1;
+	if (Config_process_browsers &&
+	    vi_process_browsers(vih, agent)) return 1;
+	if (Config_process_tld &&
+	    vi_process_tld(vih, host)) return 1;
+	if (Config_process_robots &&
+	    vi_process_robots(vih, req, agent)) return 1;
+	return 0;
+}
+
 /* Match a log line against --grep and --exclude patters to check
  * if the line must be processed or not. */
 int vi_match_line(char *line)
@@ -1658,11 +2414,98 @@ int vi_match_line(char *line)
     return 1;
 }
 
+/* Process the reports generated for every log line that don't depend on
+ * the visitors: with the pipeline this runs in a different thread than
+ * vi_process_line_visits(), so the referer is passed as 'ref' as the
+ * other thread may alter ll->ref. Return non-zero on out of memory. */
+int vi_process_line_hits(struct vih *vih, struct logline *ll, char *ref,
+	int is404)
+{
+        /* We process 404 errors first, in order to skip
+         * all the other reports if --ignore-404 option is active. */
+	if (is404 && vi_process_error404(vih, ll->req)) return 1;
+        /* Process screen info if needed. */
+        if (Config_process_screen_info && is404)
+            if (vi_process_screen_info(vih, ll->req)) return 1;
+        /* 404 error AND --ignore-404? Stop processing of this line. */
+        if (Config_ignore_404 && is404)
+            return 0;
+
+	/* The following are processed for every log line */
+	if (vi_process_page_request(vih, ll->req)) return 1;
+	if (Config_process_google &&
+	    vi_process_googled(vih, ll->req, ll->agent, ll->time))
+		return 1;
+	if (Config_process_web_trails &&
+	    vi_process_web_trails(vih, ref, ll->req)) return 1;
+	return 0;
+}
+
+/* Process the unique visitors and the reports depending on them.
+ * Return non-zero on out of memory. */
+int vi_process_line_visits(struct vih *vih, struct logline *ll, int is404)
+{
+	char visit[VI_LINE_MAX];
+
+        if (Config_ignore_404 && is404)
+            return 0;
+        /* Now it's time to process unique visitors. The 'save'
+         * local var saves if this log line is about a new visit
+         * or not. Some report is generated only against the first
+         * line of every visitor, other reports are generated
+         * for every single log line. */
+	if (vi_process_visitors_per_day(vih, ll->host, ll->agent,
+				ll->date, ll->ref, ll->req, visit, &vih->seen))
+		return 1;
+	/* This alters ll->ref, so it must be called after the reports
+	 * using the referer of the line. */
+	if (Config_process_google_keyphrases &&
+	    vi_process_google_keyphrases(vih, ll->ref, ll->time))
+		return 1;
+
+	/* The following are processed only for new visits */
+	if (vih->seen) return 0;
+	if (vih->defer)
+		return vi_defer_visit(vih, 0, visit[0] ? visit : NULL,
+			ll->date, ll->host, ll->agent, ll->ref, ll->req,
+			ll->time, &ll->tm);
+	return vi_process_new_visit(vih, ll->host, ll->agent, ll->ref,
+				ll->req, ll->time, &ll->tm);
+}
+
+/* Return non-zero if the time 't' is outside the --from --to period. */
+static int vi_outside_period(time_t t)
+{
+	return (Config_from && t < Config_from) || (Config_to && t > Config_to);
+}
+
+/* Parse the line 'l' like vi_parse_line(), skipping the entries outside
+ * the --from --to period: for them 2 is returned. Used by all the paths
+ * processing lines, so that they filter the same way. */
+int vi_parse_line_period(struct logline *ll, char *l)
+{
+	int retval;
+
+	/* Check the time of the entry before to parse the whole line.
+	 * With --log-format the date is only found splitting the line,
+	 * so it's checked after. */
+	if ((Config_from || Config_to) && !vi_log_format()) {
+		time_t t = vi_line_time(l, strlen(l));
+
+		if (t != (time_t)-1 && vi_outside_period(t)) return 2;
+	}
+	retval = vi_parse_line(ll, l);
+	if (retval == 0 && (Config_from || Config_to) &&
+	    vi_outside_period(ll->time)) return 2;
+	return retval;
+}
+
 /* Process a line of log. Returns non-zero on error. */
 int vi_process_line(struct vih *vih, char *l)
 {
 	struct logline ll;
 	char origline[VI_LINE_MAX];
+	int retval;
 
         /* Test the line against --grep --exclude patterns before
          * to process it. */
@@ -1671,66 +2514,24 @@ int vi_process_line(struct vih *vih, char *l)
                 return 0; /* No match? skip. */
         }
 
-	vih->processed++;
-	/* Take a copy of the original log line before to
-	 * copy it. Will be useful for some processing.
-	 * Do it only if required in order to speedup. */
-	if (Config_process_error404 || Config_debug)
+	/* Take a copy of the original log line before to split it,
+	 * to show it if it's invalid. */
+	if (Config_debug)
 		vi_strlcpy(origline, l, VI_LINE_MAX);
 	/* Split the line and run all the selected processing. */
-	if (vi_parse_line(&ll, l) == 0) {
-		int seen, is404;
-
-                /* We process 404 errors first, in order to skip
-                 * all the other reports if --ignore-404 option is active. */
-		if (Config_process_error404 &&
-		    vi_process_error404(vih, origline, ll.req, &is404))
-                        goto oom;
-                /* Process screen info if needed. */
-                if (Config_process_screen_info && is404)
-                    if (vi_process_screen_info(vih, ll.req)) goto oom;
-                /* 404 error AND --ignore-404? Stop processing of this line. */
-                if (Config_ignore_404 && is404)
-                    return 0;
-
-                /* Now it's time to process unique visitors. The 'save'
-                 * local var saves if this log line is about a new visit
-                 * or not. Some report is generated only against the first
-                 * line of every visitor, other reports are generated
-                 * for every single log line. */
-		if (vi_process_visitors_per_day(vih, ll.host, ll.agent,
-					ll.date, ll.ref, ll.req, &seen))
-			goto oom;
-
-		/* The following are processed for every log line */
-		if (vi_process_page_request(vih, ll.req)) goto oom;
-		if (Config_process_google &&
-		    vi_process_googled(vih, ll.req, ll.agent, ll.time))
-			goto oom;
-		if (Config_process_web_trails &&
-		    vi_process_web_trails(vih, ll.ref, ll.req)) goto oom;
-		if (Config_process_google_keyphrases &&
-		    vi_process_google_keyphrases(vih, ll.ref, ll.time))
-			goto oom;
+	if ((retval = vi_parse_line_period(&ll, l)) == 0) {
+		int is404 = 0;
 
-		/* The following are processed only for new visits */
-		if (seen) return 0;
-		vi_process_date_and_hour(vih, (ll.tm.tm_wday+6)%7,
-				ll.tm.tm_hour);
-		vi_process_month_and_day(vih, ll.tm.tm_mon, ll.tm.tm_mday-1);
-		if (vi_process_referer(vih, ll.ref, ll.time)) goto oom;
-		if (Config_process_agents &&
-		    vi_process_agents(vih, ll.agent)) goto oom;
-		if (Config_process_os &&
-		    vi_process_os(vih, ll.agent)) goto oom;
-		if (Config_process_browsers &&
-		    vi_process_browsers(vih, ll.agent)) goto oom;
-		if (Config_process_tld &&
-		    vi_process_tld(vih, ll.host)) goto oom;
-		if (Config_process_robots &&
-		    vi_process_robots(vih, ll.req, ll.agent)) goto oom;
+		vih->processed++;
+		if (Config_process_error404) is404 = ll.status == 404;
+		if (vi_process_line_hits(vih, &ll, ll.ref, is404) ||
+		    vi_process_line_visits(vih, &ll, is404)) goto oom;
+		return 0;
+	} else if (retval == -1 || retval == 2) {
+		/* Not a log entry, or outside the --from --to period. */
 		return 0;
 	} else {
+		vih->processed++;
 		vih->invalid++;
                 if (Config_debug)
                     fprintf(stderr, "Invalid line: %s\n", origline);
@@ -1741,93 +2542,2393 @@ oom:
 	return 1;
 }
 
-/* Process the specified log file. Returns zero on success.
- * On error non zero is returned and an error is set in the handle. */
-int vi_scan(struct vih *vih, char *filename)
+/* Process all the complete lines inside the buffer 'buf' of 'len' bytes.
+ * Newlines are replaced in place by nul terms so that every line is
+ * handed to the parser without to copy it, whatever its length.
+ *
+ * On success the number of bytes consumed is returned, that is, the
+ * bytes up to the end of the last complete line. On error -1 is returned
+ * and an error is set in the handle. */
+long vi_process_buffer(struct vih *vih, char *buf, long len)
 {
-	FILE *fp;
-	char buf[VI_LINE_MAX];
-	int use_stdin = 0;
+	char *p = buf, *end = buf+len, *nl;
 
-	if (filename[0] == '-' && filename[1] == '\0') {
-		/* If we are in stream mode, just return. Stdin
-		 * is implicit in this mode and will be read
-		 * after all the other files are processed. */
-		if (Config_stream_mode) return 0;
-		fp = stdin;
-		use_stdin = 1;
-	} else {
-		if ((fp = fopen(filename, "r")) == NULL) {
-			vi_set_error(vih, "Unable to open '%s': '%s'", filename, strerror(errno));
-			return 1;
-		}
+	while(p < end && (nl = memchr(p, '\n', end-p)) != NULL) {
+		*nl = '\0';
+		if (vi_process_line(vih, p)) return -1;
+		p = nl+1;
+	}
+	return p-buf;
+}
+
+/* Process the last line of a file when it is not newline terminated.
+ * If 'room' is non-zero the byte after the line can be used for the
+ * nul term, otherwise the line is copied.
+ * Returns non-zero on error. */
+int vi_process_tail(struct vih *vih, char *buf, long len, int room)
+{
+	char *line;
+	int retval;
+
+	if (len == 0) return 0;
+	if (room) {
+		buf[len] = '\0';
+		return vi_process_line(vih, buf);
+	}
+	if ((line = malloc(len+1)) == NULL) {
+		vi_set_error(vih, "Out of memory processing data");
+		return 1;
+	}
+	memcpy(line, buf, len);
+	line[len] = '\0';
+	retval = vi_process_line(vih, line);
+	free(line);
+	return retval;
+}
+
+/* Process the lines in the 'len' bytes at 'buf', that are the last part
+ * of the file if 'last' is non-zero: in this case the last line may not
+ * be newline terminated. Returns non-zero on error. */
+int vi_process_range(struct vih *vih, char *buf, long len, int last)
+{
+	long used = vi_process_buffer(vih, buf, len);
+
+	if (used == -1) return 1;
+	if (last) return vi_process_tail(vih, buf+used, len-used, 0);
+	return 0;
+}
+
+#ifdef VI_HAVE_PTHREADS
+/* ------------------------------- the pipeline -------------------------------
+ * Input that can't be split among threads, like stdin, pipes and
+ * compressed files, is processed by a pipeline of stages instead:
+ *
+ * - The reader (the calling thread) fills batches of complete lines and
+ *   hands them to the parser threads in round robin.
+ * - Every parser thread splits and parses the lines of its batches,
+ *   producing an array of records, one for every valid line.
+ * - Two aggregator threads own a group of hashtables each: one runs
+ *   vi_process_line_visits() (unique visitors and the reports depending
+ *   on them), the other vi_process_line_hits() (pages, images, 404
+ *   errors, crawlers, trails). They consume the batches in the same
+ *   round robin order, so the lines are processed in the original order
+ *   and the result is the same as a sequential run.
+ *
+ * Stages are connected by lock-free single-producer/single-consumer
+ * rings, one for every parser/aggregator pair.
+ *
+ * The lines of W3C logs depend on the "#Fields:" directives before them:
+ * the reader follows the directives and gives every batch the columns
+ * at its start, see vi_pipe_send(). */
+
+/* Size of the batches of lines */
+#define VI_PIPE_BATCH (1024*1024)
+/* Number of batches in flight for every ring */
+#define VI_PIPE_RING 4
+
+/* A parsed line */
+struct vi_record {
+	struct logline ll;
+	char *ref;		/* referer for vi_process_line_hits() */
+	int is404;
+	char day[VI_W3C_DAY_MAX]; /* ll.date of W3C lines, that is not in
+				     the line, see vi_parse_batch() */
+};
+
+/* A batch of lines, released when both the aggregators are done. */
+struct vi_batch {
+	char *buf;
+	long len;
+	struct vi_w3c_columns w3c;	/* W3C columns at the start */
+	struct vi_record *rec;
+	int records;
+	int refcount;
+};
+
+struct vi_pipe;
+
+/* A thread of the pipeline. */
+struct vi_stage {
+	struct vi_pipe *pipe;
+	pthread_t thread;
+	int id;			/* parser number */
+	struct vih *vih;	/* handle of the aggregator */
+	int processed;		/* counters of the parser */
+	int invalid;
+	int failed;		/* aggregator out of memory */
+};
+
+struct vi_pipe {
+	int parsers;
+	int rings;			/* rings allocated for every stage */
+	struct vi_ring **in;		/* reader -> parser rings */
+	struct vi_ring **visits;	/* parser -> visits aggregator */
+	struct vi_ring **hits;		/* parser -> hits aggregator */
+	struct vi_stage *parser;
+	struct vi_stage agg[2];		/* visits and hits aggregators */
+	struct vi_logformat *format;	/* see vi_select_format() */
+	struct vi_w3c_columns w3c;	/* W3C columns of the reader */
+};
+
+void vi_batch_release(struct vi_batch *b)
+{
+	int i;
+
+	if (__atomic_sub_fetch(&b->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	for (i = 0; i < b->records; i++)
+		if (b->rec[i].ref != b->rec[i].ll.ref) free(b->rec[i].ref);
+	free(b->rec);
+	free(b->buf);
+	free(b);
+}
+
+/* Split and parse the lines of the batch, like vi_process_line() does.
+ * Lines that can't be parsed produce no record. */
+void vi_parse_batch(struct vi_stage *s, struct vi_batch *b)
+{
+	char *p = b->buf, *end = b->buf+b->len, *nl;
+	char origline[VI_LINE_MAX];
+	int size = 0, ret, i, w3c;
+
+	Log_format = s->pipe->format;
+	w3c = Log_format && Log_format->w3c;
+	vi_logformat_columns(&b->w3c);
+	while(p < end && (nl = memchr(p, '\n', end-p)) != NULL) {
+		struct vi_record *r;
+		char *l = p;
+
+		*nl = '\0';
+		p = nl+1;
+		if (Config_grep_pattern_num && vi_match_line(l) == 0)
+			continue;
+		if (Config_debug)
+			vi_strlcpy(origline, l, VI_LINE_MAX);
+		if (b->records == size) {
+			size = size ? size*2 : 1024;
+			r = realloc(b->rec, sizeof(*r)*size);
+			if (r == NULL) {
+				/* Out of memory: the aggregators will report it,
+				 * see vi_pipe_aggregator(). */
+				free(b->rec);
+				b->rec = NULL;
+				b->records = -1;
+				vi_logformat_columns(NULL);
+				return;
+			}
+			b->rec = r;
+		}
+		r = &b->rec[b->records];
+		if ((ret = vi_parse_line_period(&r->ll, l)) != 0) {
+			/* Not a log entry, or outside the period. */
+			if (ret == -1 || ret == 2) continue;
+			s->processed++;
+			s->invalid++;
+			if (Config_debug)
+				fprintf(stderr, "Invalid line: %s\n", origline);
+			continue;
+		}
+		s->processed++;
+		/* The day of W3C lines is overwritten by the next line. */
+		if (w3c) vi_strlcpy(r->day, r->ll.date, sizeof(r->day));
+		r->is404 = 0;
+		if (Config_process_error404)
+			r->is404 = r->ll.status == 404;
+		/* The keyphrases processing alters the referer, give the
+		 * web trails their own copy. */
+		r->ref = r->ll.ref;
+		if (Config_process_web_trails &&
+		    Config_process_google_keyphrases &&
+		    (r->ref = strdup(r->ll.ref)) == NULL)
+			r->ref = r->ll.ref;
+		b->records++;
+	}
+	vi_logformat_columns(NULL);
+	/* The records don't move anymore. */
+	for (i = 0; w3c && i < b->records; i++)
+		b->rec[i].ll.date = b->rec[i].day;
+}
+
+void *vi_pipe_parser(void *arg)
+{
+	struct vi_stage *s = arg;
+	struct vi_pipe *pipe = s->pipe;
+	struct vi_batch *b;
+
+	do {
+		if ((b = vi_ring_get(pipe->in[s->id])) != NULL)
+			vi_parse_batch(s, b);
+		vi_ring_put(pipe->visits[s->id], b);
+		vi_ring_put(pipe->hits[s->id], b);
+	} while(b);
+	return NULL;
+}
+
+/* Aggregators take the batches from the parsers in the same order the
+ * reader dispatched them. After an error the batches are just released. */
+void *vi_pipe_aggregator(void *arg)
+{
+	struct vi_stage *s = arg;
+	struct vi_pipe *pipe = s->pipe;
+	struct vi_ring **ring = s == &pipe->agg[0] ? pipe->visits : pipe->hits;
+	struct vi_batch *b;
+	long seq = 0;
+
+	while((b = vi_ring_get(ring[seq % pipe->parsers])) != NULL) {
+		int i;
+
+		if (b->records == -1) s->failed = 1;
+		for (i = 0; i < b->records && !s->failed; i++) {
+			struct vi_record *r = &b->rec[i];
+
+			if (s == &pipe->agg[0])
+				s->failed = vi_process_line_visits(s->vih,
+						&r->ll, r->is404);
+			else
+				s->failed = vi_process_line_hits(s->vih,
+						&r->ll, r->ref, r->is404);
+		}
+		vi_batch_release(b);
+		seq++;
+	}
+	return NULL;
+}
+
+/* Send the 'len' bytes of complete lines at 'buf' to the next parser.
+ * Returns non-zero on out of memory. */
+int vi_pipe_send(struct vi_pipe *pipe, long seq, char *buf, long len)
+{
+	struct vi_batch *b;
+
+	if ((b = malloc(sizeof(*b))) == NULL) return 1;
+	b->buf = buf;
+	b->len = len;
+	/* The columns at the start of the next batch are the ones of the
+	 * last directive of this one, if any. */
+	b->w3c = pipe->w3c;
+	vi_logformat_columns(&pipe->w3c);
+	vi_logformat_follow(pipe->format, buf, len);
+	vi_logformat_columns(NULL);
+	b->rec = NULL;
+	b->records = 0;
+	b->refcount = 2;
+	vi_ring_put(pipe->in[seq % pipe->parsers], b);
+	return 0;
+}
+
+/* Send the end of the input to the parsers, the next batch being 'seq',
+ * and wait for them to exit. */
+void vi_pipe_stop(struct vi_pipe *pipe, long seq)
+{
+	int j, parsers = pipe->parsers;
+
+	for (j = 0; j < parsers; j++)
+		vi_ring_put(pipe->in[(seq+j) % parsers], NULL);
+	for (j = 0; j < parsers; j++)
+		pthread_join(pipe->parser[j].thread, NULL);
+}
+
+void vi_pipe_free(struct vi_pipe *pipe)
+{
+	int j;
+
+	for (j = 0; j < pipe->rings; j++) {
+		vi_ring_free(pipe->in[j]);
+		vi_ring_free(pipe->visits[j]);
+		vi_ring_free(pipe->hits[j]);
+	}
+	free(pipe->in);
+	free(pipe->visits);
+	free(pipe->hits);
+	free(pipe->parser);
+	free(pipe);
+}
+
+/* Create the pipeline and start the threads. The visits aggregator uses
+ * the handle 'vih'. Returns NULL on error. */
+struct vi_pipe *vi_pipe_new(struct vih *vih, int parsers)
+{
+	struct vi_pipe *pipe;
+	int j, started = 0;
+
+	if ((pipe = calloc(1, sizeof(*pipe))) == NULL) return NULL;
+	pipe->rings = parsers;
+	pipe->in = calloc(parsers, sizeof(struct vi_ring*));
+	pipe->visits = calloc(parsers, sizeof(struct vi_ring*));
+	pipe->hits = calloc(parsers, sizeof(struct vi_ring*));
+	pipe->parser = calloc(parsers, sizeof(struct vi_stage));
+	if (!pipe->in || !pipe->visits || !pipe->hits || !pipe->parser)
+		goto err;
+	for (j = 0; j < parsers; j++) {
+		pipe->in[j] = vi_ring_new(VI_PIPE_RING);
+		pipe->visits[j] = vi_ring_new(VI_PIPE_RING);
+		pipe->hits[j] = vi_ring_new(VI_PIPE_RING);
+		if (!pipe->in[j] || !pipe->visits[j] || !pipe->hits[j])
+			goto err;
+		pipe->parser[j].pipe = pipe;
+		pipe->parser[j].id = j;
+	}
+	pipe->agg[0].pipe = pipe->agg[1].pipe = pipe;
+	pipe->agg[0].vih = vih;
+	if ((pipe->agg[1].vih = vi_new()) == NULL) goto err;
+	for (j = 0; j < parsers; j++) {
+		if (pthread_create(&pipe->parser[j].thread, NULL,
+					vi_pipe_parser, &pipe->parser[j]))
+			break;
+		started++;
+	}
+	/* Use the parsers we got. Both the aggregators are needed instead,
+	 * on error the parsers are stopped: the end of the input is then
+	 * forwarded to the aggregator already started, if any. */
+	pipe->parsers = started;
+	if (started == 0) goto err;
+	if (pthread_create(&pipe->agg[0].thread, NULL, vi_pipe_aggregator,
+				&pipe->agg[0])) {
+		vi_pipe_stop(pipe, 0);
+		goto err;
+	}
+	if (pthread_create(&pipe->agg[1].thread, NULL, vi_pipe_aggregator,
+				&pipe->agg[1])) {
+		vi_pipe_stop(pipe, 0);
+		pthread_join(pipe->agg[0].thread, NULL);
+		goto err;
+	}
+	return pipe;
+err:
+	vi_free(pipe->agg[1].vih);
+	vi_pipe_free(pipe);
+	return NULL;
+}
+
+/* Stop the pipeline and merge the result in 'vih'.
+ * Returns non-zero on out of memory. */
+int vi_pipe_end(struct vi_pipe *pipe, struct vih *vih, long seq)
+{
+	int j, retval = 0;
+
+	vi_pipe_stop(pipe, seq);
+	for (j = 0; j < pipe->parsers; j++) {
+		vih->processed += pipe->parser[j].processed;
+		vih->invalid += pipe->parser[j].invalid;
+	}
+	pthread_join(pipe->agg[0].thread, NULL);
+	pthread_join(pipe->agg[1].thread, NULL);
+	if (pipe->agg[0].failed || pipe->agg[1].failed ||
+	    vi_merge(vih, pipe->agg[1].vih))
+		retval = 1;
+	vi_free(pipe->agg[1].vih);
+	vi_pipe_free(pipe);
+	return retval;
+}
+
+/* Process the data returned by the reader 'r' with the pipeline, using
+ * 'parsers' parser threads. The 'len' bytes at 'data' were already read.
+ * Returns zero on success, -1 if the pipeline can't be started, otherwise
+ * non-zero is returned and an error is set in the handle. */
+int vi_scan_pipeline(struct vih *vih, struct vi_reader *r, int parsers,
+		char *data, long len)
+{
+	struct vi_pipe *pipe;
+	char *buf;
+	long size = VI_PIPE_BATCH+len, seq = 0;
+	int retval = 0;
+
+	if ((buf = malloc(size)) == NULL) {
+		vi_set_error(vih, "Out of memory processing data");
+		return 1;
+	}
+	if ((pipe = vi_pipe_new(vih, parsers)) == NULL) {
+		free(buf);
+		return -1;
+	}
+	pipe->format = vi_log_format();
+	memcpy(buf, data, len);
+	while(1) {
+		/* Always leave room for the newline of the last line. */
+		long nread = vi_reader_read(r, buf+len, size-len-1), used;
+		char *next;
+
+		if (nread == -1) {
+			vi_set_error(vih, "%s", vi_reader_error(r));
+			retval = 1;
+			break;
+		}
+		if (nread == 0) {
+			if (len) {
+				if (buf[len-1] != '\n') buf[len++] = '\n';
+				if (vi_pipe_send(pipe, seq++, buf, len))
+					goto oom;
+				buf = NULL;
+			}
+			break;
+		}
+		len += nread;
+		/* Search the end of the last complete line. */
+		for (used = len; used > 0 && buf[used-1] != '\n'; used--);
+		if (used == 0) {
+			if (len == size-1) {
+				char *newbuf = realloc(buf, size*2);
+
+				if (newbuf == NULL) goto oom;
+				buf = newbuf;
+				size *= 2;
+			}
+			continue;
+		}
+		/* The incomplete line goes to the next batch. */
+		size = (len-used)+VI_PIPE_BATCH;
+		if ((next = malloc(size)) == NULL) goto oom;
+		memcpy(next, buf+used, len-used);
+		if (vi_pipe_send(pipe, seq++, buf, used)) {
+			free(next);
+			goto oom;
+		}
+		buf = next;
+		len -= used;
+	}
+	free(buf);
+	if (vi_pipe_end(pipe, vih, seq) && !retval) {
+		vi_set_error(vih, "Out of memory processing data");
+		retval = 1;
+	}
+	return retval;
+oom:
+	free(buf);
+	vi_pipe_end(pipe, vih, seq);
+	vi_set_error(vih, "Out of memory processing data");
+	return 1;
+}
+#endif
+
+/* Process the data returned by the reader 'r' in big blocks, used for
+ * stdin, pipes, compressed files and files that can't be mapped in
+ * memory. A line never gets split: if it does not fit in the buffer
+ * the buffer is enlarged.
+ * Returns zero on success, otherwise non-zero is returned and an error
+ * is set in the handle. */
+int vi_scan_reader(struct vih *vih, struct vi_reader *r, char *filename)
+{
+	char *buf;
+	long size = VI_READ_CHUNK, len = 0, used;
+	int retval = 0;
+
+	if ((buf = malloc(size)) == NULL) goto oom;
+	/* With --log-format auto read the start of the input to detect
+	 * its format. */
+	if (Config_log_format_auto) {
+		long nread = 0;
+
+		while(len < VI_DETECT_SAMPLE &&
+		      (nread = vi_reader_read(r, buf+len, size-len-1)) > 0)
+			len += nread;
+		if (nread == -1) {
+			vi_set_error(vih, "%s", vi_reader_error(r));
+			free(buf);
+			return 1;
+		}
+		vi_select_format(filename, buf, len);
+	}
+#ifdef VI_HAVE_PTHREADS
+	/* With more threads use the pipeline, see above. */
+	if (vih->threads > 1 &&
+	    (retval = vi_scan_pipeline(vih, r, vih->threads-1, buf, len)) != -1)
+	{
+		free(buf);
+		return retval;
+	}
+	retval = 0;
+#endif
+	/* Process the complete lines of the sample. */
+	if (len) {
+		if ((used = vi_process_buffer(vih, buf, len)) == -1) {
+			free(buf);
+			return 1;
+		}
+		memmove(buf, buf+used, len-used);
+		len -= used;
+	}
+	while(1) {
+		/* Always leave room for the nul term of the last line. */
+		long nread = vi_reader_read(r, buf+len, size-len-1);
+
+		if (nread == -1) {
+			vi_set_error(vih, "%s", vi_reader_error(r));
+			retval = 1;
+			break;
+		}
+		if (nread == 0) {
+			retval = vi_process_tail(vih, buf, len, 1);
+			break;
+		}
+		len += nread;
+		if ((used = vi_process_buffer(vih, buf, len)) == -1) {
+			retval = 1;
+			break;
+		}
+		memmove(buf, buf+used, len-used);
+		len -= used;
+		if (len == size-1) {
+			char *newbuf = realloc(buf, size*2);
+
+			if (newbuf == NULL) goto oom;
+			buf = newbuf;
+			size *= 2;
+		}
+	}
+	free(buf);
+	return retval;
+oom:
+	free(buf);
+	vi_set_error(vih, "Out of memory processing data");
+	return 1;
+}
+
+/* Process the file descriptor 'fd' using a reader, so that compressed
+ * input is detected and decompressed on the fly.
+ * Returns zero on success, non-zero on error. */
+int vi_scan_fd(struct vih *vih, int fd, char *filename)
+{
+	struct vi_reader *r;
+	int retval;
+
+	if ((r = vi_reader_new_fd(fd)) == NULL) {
+		vi_set_error(vih, "Out of memory processing data");
+		return 1;
+	}
+	retval = vi_scan_reader(vih, r, filename);
+	vi_reader_free(r);
+	return retval;
+}
+
+#ifdef VI_HAVE_MMAP
+/* Find the first entry with a known time in the log data mapped at 'map',
+ * starting from the line at or after the offset 'off' and ending at
+ * 'size'. Its offset and its time are stored at 'line' and 't'.
+ * Returns 1 if found, 0 if there are no more lines, and -1 if there are
+ * too many invalid lines to find it. */
+static int vi_period_probe(char *map, size_t size, size_t off, size_t *line,
+		time_t *t)
+{
+	int tries = VI_PERIOD_TRIES;
+	char *nl;
+
+	if (off && off < size && map[off-1] != '\n') {
+		nl = memchr(map+off, '\n', size-off);
+		off = nl ? (size_t)(nl-map)+1 : size;
+	}
+	while(off < size && tries--) {
+		size_t len;
+
+		nl = memchr(map+off, '\n', size-off);
+		len = nl ? (size_t)(nl-map)-off : size-off;
+		if ((*t = vi_line_time(map+off, len)) != (time_t)-1) {
+			*line = off;
+			return 1;
+		}
+		off += len+1;
+	}
+	*line = size;
+	return (off >= size) ? 0 : -1;
+}
+
+/* Binary search in the lines between 'lo' and 'hi' the first line with
+ * a time not less than 'target', storing its offset at 'res'. Lines up
+ * to the end of the data at 'size' may be looked at.
+ * Returns non-zero if the lines have no usable times. */
+static int vi_period_search(char *map, size_t size, size_t lo, size_t hi,
+		time_t target, size_t *res)
+{
+	size_t line;
+	time_t t;
+	int ret;
+
+	while(lo < hi) {
+		size_t mid = lo+(hi-lo)/2;
+
+		if ((ret = vi_period_probe(map, size, mid, &line, &t)) == -1)
+			return 1;
+		if (ret == 0 || t >= target)
+			hi = mid;
+		else
+			lo = line+1;
+	}
+	if (lo && lo < size && map[lo-1] != '\n') {
+		char *nl = memchr(map+lo, '\n', size-lo);
+
+		lo = nl ? (size_t)(nl-map)+1 : size;
+	}
+	*res = lo;
+	return 0;
+}
+
+/* With --from or --to narrow the range from '*start' to '*end' of the
+ * plain log data mapped at 'map' to the lines inside the period, so that
+ * analysing a day of a big log does not need to parse all the others.
+ * The lines are found with a binary search if the log is sorted by time,
+ * checking the time of a few evenly spaced lines. Otherwise the range is
+ * not changed, and the lines are just filtered by vi_process_line().
+ * The range always starts and ends at a line boundary. */
+void vi_period_range(char *map, size_t *start, size_t *end)
+{
+	size_t from = *start, to = *end, line;
+	time_t t, max = 0;
+	int j, ret, found = 0;
+
+	for (j = 0; j < VI_PERIOD_PROBES; j++) {
+		ret = vi_period_probe(map, *end,
+			*start+(*end-*start)/VI_PERIOD_PROBES*j, &line, &t);
+		if (ret == -1) return;
+		if (ret == 0) break;
+		if (found && t < max-VI_PERIOD_SLACK) return; /* not sorted */
+		if (!found || t > max) max = t;
+		found = 1;
+	}
+	if (!found) return;
+	if (Config_from && vi_period_search(map, *end, from, to,
+				Config_from-VI_PERIOD_SLACK, &from)) return;
+	if (Config_to && vi_period_search(map, *end, from, to,
+				Config_to+VI_PERIOD_SLACK+1, &to)) return;
+	*start = from;
+	*end = to;
+}
+
+/* Process a regular file mapping it in memory. The mapping is private
+ * and writable, so vi_parse_line() can split the lines in place: only
+ * the pages actually touched are duplicated by the kernel, and there is
+ * no stdio buffering and locking involved. Compressed files are
+ * decompressed directly from the mapping.
+ *
+ * With --state only the data not processed by the previous run is
+ * processed, and the last line is left for the next run if it is not
+ * newline terminated, see vi_state_offset().
+ *
+ * Returns zero on success. If the file can't be mapped -1 is returned
+ * without to set any error so that the caller can fall back to read(2).
+ * On processing error 1 is returned and an error is set in the handle. */
+int vi_scan_mmap(struct vih *vih, int fd, char *filename, struct stat *sb)
+{
+	off_t size = sb->st_size, start = 0;
+	char *map;
+	int retval = 0, compressed;
+
+	if (size == 0) {
+		if (State) vi_state_end(filename, sb, 0);
+		return 0;
+	}
+	if ((off_t)(size_t)size != size) return -1; /* too big for us */
+	map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return -1;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, size, MADV_SEQUENTIAL);
+#endif
+	compressed = vi_reader_detect(map, size) != VI_READER_PLAIN;
+	if (State) start = vi_state_offset(sb, compressed);
+	if (compressed) {
+		struct vi_reader *r = NULL;
+
+		if (start == 0 && (r = vi_reader_new_mem_mt(map, size,
+						vih->threads)) == NULL) {
+			vi_set_error(vih, "Out of memory processing data");
+			retval = 1;
+		} else if (r) {
+			retval = vi_scan_reader(vih, r, filename);
+			vi_reader_free(r);
+		}
+		if (State && !retval) vi_state_end(filename, sb, size);
+	} else if (State) {
+		long used;
+
+		vi_select_format(filename, map, size);
+		vi_logformat_seek(vi_log_format(), map, 0, start);
+		used = vi_process_buffer(vih, map+start, size-start);
+
+		if (used == -1) retval = 1;
+		else vi_state_end(filename, sb, start+used);
+	} else {
+		size_t from = 0, to = size;
+
+		vi_select_format(filename, map, size);
+		if (Config_from || Config_to) {
+			vi_logformat_seek(vi_log_format(), map, 0, size);
+			vi_period_range(map, &from, &to);
+		}
+		vi_logformat_seek(vi_log_format(), map, 0, from);
+		retval = vi_process_range(vih, map+from, to-from, to == (size_t)size);
+	}
+	munmap(map, size);
+	return retval;
+}
+#endif
+
+/* Process the specified log file. Returns zero on success.
+ * On error non zero is returned and an error is set in the handle. */
+int vi_scan(struct vih *vih, char *filename)
+{
+	int fd, retval = -1;
+
+	/* Every log starts with its own W3C directives. */
+	vi_logformat_seek(vi_log_format(), NULL, 0, 0);
+	if (filename[0] == '-' && filename[1] == '\0') {
+		/* If we are in stream mode, just return. Stdin
+		 * is implicit in this mode and will be read
+		 * after all the other files are processed. */
+		if (Config_stream_mode) return 0;
+		fd = 0;
+	} else {
+		if ((fd = open(filename, O_RDONLY)) == -1) {
+			vi_set_error(vih, "Unable to open '%s': '%s'", filename, strerror(errno));
+			return 1;
+		}
+#ifdef VI_HAVE_MMAP
+		{
+			struct stat sb;
+
+			/* Regular files are mapped in memory, pipes, devices
+			 * and files we can't map are read in blocks. */
+			if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+				retval = vi_scan_mmap(vih, fd, filename, &sb);
+				/* The state needs the offsets in the file. */
+				if (retval == -1 && State) {
+					vi_set_error(vih, "Can't map the file in "
+						"memory, required by --state");
+					retval = 1;
+				}
+			}
+		}
+#endif
+	}
+	if (retval == -1)
+		retval = vi_scan_fd(vih, fd, fd == 0 ? NULL : filename);
+	if (fd != 0)
+		close(fd);
+	if (retval) {
+		fprintf(stderr, "%s: %s\n", filename, vi_get_error(vih));
+		return 1;
+	}
+	vih->endt = time(NULL);
+	return 0;
+}
+
+/* ---------------------------- asynchronous reads ----------------------------
+ * With --io-uring the log files are read in blocks, keeping up to
+ * VI_ASYNC_BUFS reads in flight: while a block is parsed the next ones,
+ * of the same file or of the files that follow, are already being read
+ * by the kernel, so that the device is never idle even with many small
+ * files. Blocks are processed in order, the result is the same as
+ * calling vi_scan() for every file.
+ *
+ * When io_uring is not available the blocks are read with pread(2) when
+ * they are needed. Compressed files, pipes and stdin are processed by
+ * vi_scan() when their turn comes. */
+
+/* A block of a log file, there is one for every buffer. */
+struct vi_async_block {
+	int file;		/* index of the file */
+	int fd;			/* -1 if the file is processed by vi_scan() */
+	off_t offset;		/* offset of the block in the file */
+	long len;		/* bytes to read */
+	long got;		/* bytes read so far */
+	int ready;		/* read completed */
+	int error;		/* errno of a failed read */
+	int first, last;	/* first and last block of the file */
+	int inflight;		/* read queued in the ring */
+};
+
+struct vi_async {
+	struct vi_uring *u;	/* NULL if reading with pread(2) */
+	char *bufs[VI_ASYNC_BUFS];
+	struct vi_async_block block[VI_ASYNC_BUFS];
+	long queued;		/* blocks queued so far */
+	long done;		/* blocks processed so far */
+	int cur;		/* next file to queue */
+	int fd;			/* descriptor of 'cur', -1 if not open */
+	off_t size;		/* size of 'cur' */
+	off_t offset;		/* offset of the next block of 'cur' */
+	char *carry;		/* last incomplete line of the previous block */
+	long carrylen;
+	long carrysize;
+};
+
+/* Open the next file to queue. Returns the descriptor, or -1 if the
+ * file must be processed by vi_scan(): in this case errors opening
+ * the file are reported by vi_scan() when its turn comes. */
+static int vi_async_open(char *filename, off_t *size)
+{
+	struct stat sb;
+	int fd;
+
+	if (filename[0] == '-' && filename[1] == '\0') return -1;
+	if ((fd = open(filename, O_RDONLY)) == -1) return -1;
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+		close(fd);
+		return -1;
+	}
+	*size = sb.st_size;
+	return fd;
+}
+
+/* Queue blocks while there are free buffers. Returns non-zero if the
+ * reads can't be queued, setting the error in the handle. */
+static int vi_async_queue(struct vih *vih, struct vi_async *a,
+		char **filenames, int count)
+{
+	while(a->queued - a->done < VI_ASYNC_BUFS && a->cur < count) {
+		int j = a->queued % VI_ASYNC_BUFS;
+		struct vi_async_block *b = &a->block[j];
+
+		memset(b, 0, sizeof(*b));
+		b->file = a->cur;
+		if (a->fd == -1) {
+			a->fd = vi_async_open(filenames[a->cur], &a->size);
+			a->offset = 0;
+			if (a->fd != -1 && a->size == 0) {
+				close(a->fd);
+				a->fd = -1;
+				a->cur++;
+				continue;
+			}
+			if (a->fd == -1) {
+				b->fd = -1;
+				b->ready = b->first = b->last = 1;
+				a->queued++;
+				a->cur++;
+				continue;
+			}
+		}
+		b->fd = a->fd;
+		b->offset = a->offset;
+		b->len = VI_ASYNC_CHUNK;
+		if (b->len > a->size - a->offset)
+			b->len = a->size - a->offset;
+		b->first = a->offset == 0;
+		b->last = a->offset+b->len == a->size;
+		if (a->u) {
+			if (vi_uring_read(a->u, b->fd, j, a->bufs[j], b->len,
+					b->offset, j))
+			{
+				vi_set_error(vih, "Error queueing a read: %s",
+					strerror(errno));
+				return 1;
+			}
+			b->inflight = 1;
+		}
+		a->queued++;
+		a->offset += b->len;
+		if (b->last) {
+			/* The descriptor is closed by the last block. */
+			a->fd = -1;
+			a->cur++;
+		}
+	}
+	if (a->u && vi_uring_submit(a->u)) {
+		vi_set_error(vih, "Error submitting reads: %s", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/* Wait for the block 'b' to be read. Returns non-zero on error. */
+static int vi_async_wait(struct vih *vih, struct vi_async *a,
+		struct vi_async_block *b)
+{
+	while(!b->ready) {
+		struct vi_async_block *c;
+		unsigned long j;
+		long res;
+
+		if (a->u == NULL) {
+			res = pread(b->fd, a->bufs[b-a->block]+b->got,
+					b->len-b->got, b->offset+b->got);
+			if (res == -1 && errno == EINTR) continue;
+			c = b;
+		} else {
+			if (vi_uring_wait(a->u, &j, &res)) {
+				vi_set_error(vih, "Error waiting for reads: %s",
+					strerror(errno));
+				return 1;
+			}
+			c = &a->block[j];
+			c->inflight = 0;
+			if (res < 0) {
+				errno = -res;
+				res = -1;
+			}
+		}
+		if (res == -1) {
+			c->error = errno;
+			c->ready = 1;
+		} else if (res == 0) {
+			/* The file was truncated while we read it. */
+			c->len = c->got;
+			c->ready = 1;
+		} else if ((c->got += res) == c->len) {
+			c->ready = 1;
+		} else if (a->u) {
+			/* Short read, ask for the rest. */
+			j = c-a->block;
+			if (vi_uring_read(a->u, c->fd, j, a->bufs[j]+c->got,
+				c->len-c->got, c->offset+c->got, j) ||
+			    vi_uring_submit(a->u))
+			{
+				c->error = errno;
+				c->ready = 1;
+			} else {
+				c->inflight = 1;
+			}
+		}
+	}
+	if (b->error) {
+		vi_set_error(vih, "Error reading the file: %s",
+				strerror(b->error));
+		return 1;
+	}
+	return 0;
+}
+
+/* Append 'len' bytes at 'p' to the incomplete line of the previous
+ * block. Returns non-zero on out of memory. */
+static int vi_async_carry(struct vi_async *a, char *p, long len)
+{
+	if (a->carrylen+len+1 > a->carrysize) {
+		long size = (a->carrylen+len+1)*2;
+		char *carry = realloc(a->carry, size);
+
+		if (carry == NULL) return 1;
+		a->carry = carry;
+		a->carrysize = size;
+	}
+	memcpy(a->carry+a->carrylen, p, len);
+	a->carrylen += len;
+	return 0;
+}
+
+/* Process the lines of the block 'b', that is the last block of the
+ * file if 'last' is non-zero. Returns non-zero on error. */
+static int vi_async_process(struct vih *vih, struct vi_async *a,
+		char *p, long len, int last)
+{
+	long used;
+
+	/* Complete the line started in the previous block. */
+	if (a->carrylen) {
+		char *nl = memchr(p, '\n', len);
+		long part = nl ? nl-p+1 : len;
+
+		if (vi_async_carry(a, p, part)) goto oom;
+		p += part;
+		len -= part;
+		if (nl) {
+			if (vi_process_buffer(vih, a->carry, a->carrylen) == -1)
+				return 1;
+			a->carrylen = 0;
+		}
+	}
+	if ((used = vi_process_buffer(vih, p, len)) == -1) return 1;
+	if (vi_async_carry(a, p+used, len-used)) goto oom;
+	if (last) {
+		if (vi_process_tail(vih, a->carry, a->carrylen, 1)) return 1;
+		a->carrylen = 0;
+	}
+	return 0;
+oom:
+	vi_set_error(vih, "Out of memory processing data");
+	return 1;
+}
+
+/* Process the log files 'filenames' as described above.
+ * Returns zero on success. On error non zero is returned, an error is
+ * set in the handle and the index of the file that failed is stored at
+ * 'failed'. */
+int vi_scan_async(struct vih *vih, char **filenames, int count, int *failed)
+{
+	struct vi_async a;
+	int j, skip = -1, retval = 0;
+
+	memset(&a, 0, sizeof(a));
+	a.fd = -1;
+	*failed = 0;
+	for (j = 0; j < VI_ASYNC_BUFS; j++) {
+		if ((a.bufs[j] = malloc(VI_ASYNC_CHUNK)) == NULL) {
+			vi_set_error(vih, "Out of memory processing data");
+			retval = 1;
+			goto cleanup;
+		}
+	}
+	a.u = vi_uring_new(VI_ASYNC_BUFS, a.bufs, VI_ASYNC_CHUNK,
+			VI_ASYNC_BUFS);
+	if (Config_debug)
+		fprintf(stderr, "Reading with %s\n", a.u == NULL ? "pread()" :
+			vi_uring_fixed(a.u) ? "io_uring, registered buffers" :
+			"io_uring");
+	while(1) {
+		struct vi_async_block *b;
+		char *buf;
+
+		if (vi_async_queue(vih, &a, filenames, count)) {
+			retval = 1;
+			break;
+		}
+		if (a.done == a.queued) break;
+		j = a.done % VI_ASYNC_BUFS;
+		b = &a.block[j];
+		buf = a.bufs[j];
+		*failed = b->file;
+		if (b->fd == -1) {
+			retval = vi_scan(vih, filenames[b->file]);
+		} else if ((retval = vi_async_wait(vih, &a, b)) != 0) {
+			/* Blocks of a file processed by vi_scan() are just
+			 * dropped, even if the read failed. */
+			if (b->file == skip) retval = 0;
+		} else if (b->file == skip) {
+			/* Already processed. */
+		} else if (b->first &&
+			   vi_reader_detect(buf, b->got) != VI_READER_PLAIN) {
+			/* Compressed: let vi_scan() process it, and stop
+			 * reading it if it is still being queued. */
+			skip = b->file;
+			if (a.cur == b->file && a.fd != -1) {
+				a.block[(a.queued-1) % VI_ASYNC_BUFS].last = 1;
+				a.fd = -1;
+				a.cur++;
+			}
+			retval = vi_scan(vih, filenames[b->file]);
+		} else {
+			if (b->first) {
+				vi_select_format(filenames[b->file], buf, b->got);
+				vi_logformat_seek(vi_log_format(), NULL, 0, 0);
+			}
+			retval = vi_async_process(vih, &a, buf, b->got, b->last);
+		}
+		if (b->fd != -1 && b->last) {
+			close(b->fd);
+			b->fd = -1;
+		}
+		a.done++;
+		if (retval) break;
+	}
+cleanup:
+	/* Wait for the reads in flight before to free the buffers, and
+	 * close the files still open. */
+	for (; a.done < a.queued; a.done++) {
+		struct vi_async_block *b = &a.block[a.done % VI_ASYNC_BUFS];
+
+		while(b->inflight) {
+			unsigned long k;
+			long res;
+
+			if (vi_uring_wait(a.u, &k, &res)) break;
+			a.block[k].inflight = 0;
+		}
+		if (b->fd != -1 && b->last) close(b->fd);
+	}
+	if (a.fd != -1) close(a.fd);
+	vi_uring_free(a.u);
+	for (j = 0; j < VI_ASYNC_BUFS; j++) free(a.bufs[j]);
+	free(a.carry);
+	vih->endt = time(NULL);
+	return retval;
+}
+
+/* -------------------------------- merge mode --------------------------------
+ * With --merge the log files are read at the same time, and their lines
+ * are processed in time order like if they were a single log. This is
+ * what is needed with the logs of multiple load balanced web servers, as
+ * visits and the age of referers and keyphrases depend on the order of
+ * the lines. Every file is read in a small lookahead buffer, and the
+ * files are kept in a min-heap keyed on the time of their current line.
+ * A line without a valid time keeps its place in its file. */
+
+struct vi_merge_input {
+	int fd;
+	struct vi_reader *r;	/* NULL if the file is read directly */
+	char *buf;		/* lookahead buffer */
+	long size;		/* size of 'buf', without the nul term */
+	long len;		/* bytes in 'buf' */
+	long pos;		/* start of the next line in 'buf' */
+	int eof;
+	char *line;		/* current line, nul terminated */
+	time_t time;		/* time of the current line */
+	struct vi_w3c_columns w3c; /* columns of the file, with --log-format
+				      w3c */
+	char *filename;
+	struct vi_logformat *format; /* see vi_select_format() */
+	int detected;		/* non-zero once 'format' is selected */
+};
+
+/* Open a log file for the merge. Compressed files and pipes are read by
+ * a vi_reader, plain files are read directly in the lookahead buffer.
+ * Returns non-zero on error, with the error set in the handle. */
+static int vi_merge_open(struct vih *vih, struct vi_merge_input *in,
+		char *filename)
+{
+	unsigned char magic[6];
+	struct stat sb;
+	ssize_t n;
+
+	if (filename[0] == '-' && filename[1] == '\0') {
+		in->fd = 0;
+	} else if ((in->fd = open(filename, O_RDONLY)) == -1) {
+		vi_set_error(vih, "Unable to open '%s': '%s'", filename,
+				strerror(errno));
+		return 1;
+	}
+	if (fstat(in->fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    (n = pread(in->fd, magic, sizeof(magic), 0)) == -1 ||
+	    vi_reader_detect(magic, n) != VI_READER_PLAIN)
+	{
+		if ((in->r = vi_reader_new_fd(in->fd)) == NULL) goto oom;
+	}
+	in->filename = in->fd == 0 ? NULL : filename;
+	in->size = VI_MERGE_BUFLEN;
+	if ((in->buf = malloc(in->size+1)) == NULL) goto oom;
+	return 0;
+oom:
+	vi_set_error(vih, "Out of memory processing data");
+	return 1;
+}
+
+static void vi_merge_close(struct vi_merge_input *in)
+{
+	if (in->r) vi_reader_free(in->r);
+	if (in->fd > 0) close(in->fd);
+	free(in->buf);
+	in->r = NULL;
+	in->fd = -1;
+	in->buf = NULL;
+}
+
+/* Move to the next line of the file. Returns 1 if there is a line,
+ * 0 at the end of the file, and -1 on error, that is set in the handle. */
+static int vi_merge_next(struct vih *vih, struct vi_merge_input *in)
+{
+	while(1) {
+		char *nl = memchr(in->buf+in->pos, '\n', in->len-in->pos);
+		long n;
+
+		if (nl || (in->eof && in->pos < in->len)) {
+			time_t t;
+
+			if (nl == NULL) nl = in->buf+in->len;
+			if (!in->detected) {
+				in->format = vi_select_format(in->filename,
+					in->buf+in->pos, in->len-in->pos);
+				in->detected = 1;
+			}
+			Log_format = in->format;
+			vi_logformat_columns(&in->w3c);
+			in->line = in->buf+in->pos;
+			*nl = '\0';
+			in->pos = nl-in->buf+1;
+			if (in->pos > in->len) in->pos = in->len;
+			t = vi_line_time(in->line, nl-in->line);
+			if (t != (time_t)-1) in->time = t;
+			return 1;
+		}
+		if (in->eof) return 0;
+		/* Move the incomplete line at the start of the buffer, and
+		 * make room for very long lines. */
+		if (in->pos) {
+			memmove(in->buf, in->buf+in->pos, in->len-in->pos);
+			in->len -= in->pos;
+			in->pos = 0;
+		}
+		if (in->len == in->size) {
+			char *buf = realloc(in->buf, in->size*2+1);
+
+			if (buf == NULL) {
+				vi_set_error(vih, "Out of memory processing data");
+				return -1;
+			}
+			in->buf = buf;
+			in->size *= 2;
+		}
+		if (in->r) {
+			n = vi_reader_read(in->r, in->buf+in->len,
+					in->size-in->len);
+			if (n == -1) {
+				vi_set_error(vih, "%s", vi_reader_error(in->r));
+				return -1;
+			}
+		} else {
+			n = read(in->fd, in->buf+in->len, in->size-in->len);
+			if (n == -1) {
+				if (errno == EINTR) continue;
+				vi_set_error(vih, "Reading: %s", strerror(errno));
+				return -1;
+			}
+		}
+		if (n == 0) in->eof = 1;
+		in->len += n;
+	}
+}
+
+/* Return non-zero if the current line of the file 'a' comes before the
+ * one of the file 'b'. Files given first win ties, so the result does
+ * not depend on the heap layout. */
+static int vi_merge_less(struct vi_merge_input *in, int a, int b)
+{
+	if (in[a].time != in[b].time) return in[a].time < in[b].time;
+	return a < b;
+}
+
+/* Restore the heap property moving down the element at 'j'. */
+static void vi_merge_sift(struct vi_merge_input *in, int *heap, int n, int j)
+{
+	while(1) {
+		int min = j, l = j*2+1, r = j*2+2, aux;
+
+		if (l < n && vi_merge_less(in, heap[l], heap[min])) min = l;
+		if (r < n && vi_merge_less(in, heap[r], heap[min])) min = r;
+		if (min == j) break;
+		aux = heap[j];
+		heap[j] = heap[min];
+		heap[min] = aux;
+		j = min;
+	}
+}
+
+/* Process the lines of the 'count' log files in time order. Returns zero
+ * on success. On error non zero is returned, the error is set in the
+ * handle, and the index of the file is stored at 'failed'. */
+int vi_scan_merge(struct vih *vih, char **filenames, int count, int *failed)
+{
+	struct vi_merge_input *in;
+	int *heap, i, n = 0, ret, retval = 0;
+
+	*failed = 0;
+	in = calloc(count, sizeof(*in));
+	heap = malloc(sizeof(int)*count);
+	if (in == NULL || heap == NULL) {
+		free(in);
+		free(heap);
+		vi_set_error(vih, "Out of memory processing data");
+		return 1;
+	}
+	for (i = 0; i < count; i++) in[i].fd = -1;
+	for (i = 0; i < count; i++) {
+		/* Stdin is read after the files in stream mode. */
+		if (Config_stream_mode && !strcmp(filenames[i], "-")) continue;
+		*failed = i;
+		if (vi_merge_open(vih, &in[i], filenames[i]) ||
+		    (ret = vi_merge_next(vih, &in[i])) == -1)
+		{
+			retval = 1;
+			goto cleanup;
+		}
+		if (ret == 1)
+			heap[n++] = i;
+		else
+			vi_merge_close(&in[i]);
+	}
+	for (i = n/2-1; i >= 0; i--)
+		vi_merge_sift(in, heap, n, i);
+	while(n) {
+		struct vi_merge_input *top = &in[heap[0]];
+
+		*failed = heap[0];
+		vi_logformat_columns(&top->w3c);
+		Log_format = top->format;
+		if (vi_process_line(vih, top->line) ||
+		    (ret = vi_merge_next(vih, top)) == -1)
+		{
+			retval = 1;
+			break;
+		}
+		if (ret == 0) {
+			vi_merge_close(top);
+			heap[0] = heap[--n];
+		}
+		vi_merge_sift(in, heap, n, 0);
+	}
+cleanup:
+	vi_logformat_columns(NULL);
+	for (i = 0; i < count; i++) vi_merge_close(&in[i]);
+	free(in);
+	free(heap);
+	vih->endt = time(NULL);
+	return retval;
+}
+
+/* Postprocessing of pageviews per visit data.
+ * The source hashtable entries are in the form: uniqe-visitor -> pageviews.
+ * After the postprocessing we obtain another hashtable in the form:
+ * pageviews-range -> quantity. This hashtable can be used directly
+ * with generic output functions to generate the output. */
+int vi_postprocess_pageviews(struct vih *vih)
+{
+	void **table;
+	int len = ht_used(&vih->pageviews), i;
+
+	/* Start from scratch, reports can be generated multiple times. */
+	ht_destroy(&vih->pageviews_grouped);
+	vi_ht_init(&vih->pageviews_grouped);
+	if ((table = ht_get_array(&vih->pageviews)) == NULL) {
+		fprintf(stderr, "Out of memory in vi_postprocess_pageviews()\n");
+		return 1;
+	}
+	/* Run the hashtable in order to populate 'pageviews_grouped' */
+	for (i = 0; i < len; i++) {
+		int pv = (long) table[(i*2)+1]; /* pageviews of visit */
+		int res;
+		char *key;
+
+		if (pv == 1) key = "1";
+		else if (pv == 2) key = "2";
+		else if (pv == 3) key = "3";
+		else if (pv == 4) key = "4";
+		else if (pv == 5) key = "5";
+		else if (pv == 6) key = "6";
+		else if (pv == 7) key = "7";
+		else if (pv == 8) key = "8";
+		else if (pv == 9) key = "9";
+		else if (pv == 10) key = "10";
+		else if (pv >= 11 && pv <= 20) key = "11-20";
+		else if (pv >= 21 && pv <= 30) key = "21-30";
+		else key = "> 30";
+
+		res = vi_counter_incr(&vih->pageviews_grouped, key);
+		if (res == 0) {
+			free(table);
+			return 1; /* out of memory */
+		}
+	}
+	free(table);
+	return 0;
+}
+
+/* This function is called from vi_print_report() in order to
+ * run some postprocessing to raw data collected needed to generate reports. */
+int vi_postprocess(struct vih *vih)
+{
+	if (vi_postprocess_pageviews(vih)) goto oom;
+	return 0;
+oom:
+	vi_set_error(vih, "Out of memory");
+	return 1;
+}
+
+/* ------------------------------ multi threading --------------------------- */
+#define VI_MERGE_COUNTER 0	/* values are summed */
+#define VI_MERGE_NEWER 1	/* the newer time is taken */
+#define VI_MERGE_OLDER 2	/* the older time is taken */
+
+/* Merge the hashtable 'src' into 'dst'. Entries that are not already
+ * in 'dst' are moved without to copy the key, the others are combined
+ * accordingly to 'type'. Return non-zero on out of memory. */
+int vi_merge_table(struct hashtable *dst, struct hashtable *src, int type)
+{
+	unsigned int idx, dstidx;
+	int ret;
+
+	for (idx = 0; (ret = ht_get_byindex(src, idx)) != -1; idx++) {
+		long a, b;
+
+		if (ret == 0) continue;
+		ret = ht_move(src, dst, idx);
+		if (ret == HT_OK) continue;
+		if (ret != HT_BUSY ||
+		    ht_search(dst, ht_key(src, idx), &dstidx) != HT_FOUND)
+			return 1;
+		a = (long) ht_value(dst, dstidx);
+		b = (long) ht_value(src, idx);
+		switch(type) {
+		case VI_MERGE_COUNTER: a += b; break;
+		case VI_MERGE_NEWER: if (b > a) a = b; break;
+		case VI_MERGE_OLDER: if (b < a) a = b; break;
+		}
+		ht_value(dst, dstidx) = (void*) a;
+	}
+	return 0;
+}
+
+/* Merge the handle 'src' into 'dst', that holds the data processed
+ * before the one of 'src'. The result is the same as processing all the
+ * data with 'dst': the deferred visits of 'src' are replayed first, and
+ * only the ones not already seen in 'dst' are new visits. The sets of
+ * visitors are then merged like all the other tables. The state of the
+ * last line, used by the bot lines that follow it, is carried in
+ * dst->seen.
+ *
+ * 'src' is left in an undefined state and must be released with
+ * vi_free(). Return non-zero on out of memory. */
+int vi_merge(struct vih *dst, struct vih *src)
+{
+	struct hashtable *counters[][2] = {
+		{&dst->visitors, &src->visitors},
+		{&dst->googlevisitors, &src->googlevisitors},
+		{&dst->pages, &src->pages},
+		{&dst->images, &src->images},
+		{&dst->error404, &src->error404},
+		{&dst->pageviews, &src->pageviews},
+		{&dst->pageviews_grouped, &src->pageviews_grouped},
+		{&dst->referers, &src->referers},
+		{&dst->date, &src->date},
+		{&dst->googledate, &src->googledate},
+		{&dst->month, &src->month},
+		{&dst->googlemonth, &src->googlemonth},
+		{&dst->agents, &src->agents},
+		{&dst->googlevisits, &src->googlevisits},
+		{&dst->googlekeyphrases, &src->googlekeyphrases},
+		{&dst->trails, &src->trails},
+		{&dst->tld, &src->tld},
+		{&dst->os, &src->os},
+		{&dst->browsers, &src->browsers},
+		{&dst->robots, &src->robots},
+		{&dst->googlehumanlanguage, &src->googlehumanlanguage},
+		{&dst->screenres, &src->screenres},
+		{&dst->screendepth, &src->screendepth},
+		{NULL, NULL}
+	};
+	struct vi_visit *v;
+	unsigned int idx;
+	int i, j;
+
+	for (v = src->visits; v; v = v->next) {
+		char *month = strchr(v->date, '/')+1;
+
+		if (v->google) {
+			if (ht_search(&dst->googlevisitors, v->key, &idx) ==
+			    HT_FOUND) continue;
+			if (!vi_counter_incr(&dst->googledate, v->date))
+				return 1;
+			if (Config_process_monthly_visitors &&
+			    !vi_counter_incr(&dst->googlemonth, month))
+				return 1;
+		} else if (v->key == NULL) {
+			if (dst->seen) continue;
+			if (vi_process_new_visit(dst, v->host, v->agent, v->ref,
+						v->req, v->time, &v->tm))
+				return 1;
+		} else {
+			dst->seen = ht_search(&dst->visitors, v->key, &idx) ==
+				HT_FOUND;
+			if (dst->seen) continue;
+			if (!vi_counter_incr(&dst->date, v->date)) return 1;
+			if (Config_process_monthly_visitors &&
+			    !vi_counter_incr(&dst->month, month))
+				return 1;
+			if (vi_process_new_visit(dst, v->host, v->agent, v->ref,
+						v->req, v->time, &v->tm))
+				return 1;
+		}
+	}
+	/* A line already seen by 'src' is not a new visit for 'dst' either,
+	 * otherwise the state was set by the replay, or is still the one of
+	 * 'dst' if 'src' has no tracked lines. */
+	if (src->seen) dst->seen = 1;
+	vi_free_visits(src);
+	for (i = 0; counters[i][0]; i++) {
+		if (vi_merge_table(counters[i][0], counters[i][1],
+					VI_MERGE_COUNTER)) return 1;
+	}
+	if (vi_merge_table(&dst->googled, &src->googled, VI_MERGE_NEWER) ||
+	    vi_merge_table(&dst->adsensed, &src->adsensed, VI_MERGE_NEWER) ||
+	    vi_merge_table(&dst->referersage, &src->referersage,
+		    VI_MERGE_OLDER) ||
+	    vi_merge_table(&dst->googlekeyphrasesage,
+		    &src->googlekeyphrasesage, VI_MERGE_OLDER))
+		return 1;
+	for (i = 0; i < 24; i++) {
+		dst->hour[i] += src->hour[i];
+		for (j = 0; j < 7; j++)
+			dst->weekdayhour[j][i] += src->weekdayhour[j][i];
+	}
+	for (i = 0; i < 7; i++) dst->weekday[i] += src->weekday[i];
+	for (i = 0; i < 31; i++)
+		for (j = 0; j < 12; j++)
+			dst->monthday[j][i] += src->monthday[j][i];
+	dst->processed += src->processed;
+	dst->invalid += src->invalid;
+	dst->blacklisted += src->blacklisted;
+	if (src->endt > dst->endt) dst->endt = src->endt;
+	return 0;
+}
+
+/* ------------------------------- state file ------------------------------- */
+/* With --state FILE the whole handle is saved at the end of the run,
+ * together with the inode, size and offset of the last complete line
+ * processed of every log file. The next run loads it and only processes
+ * the data appended since then: files with a different inode are
+ * rotated, and shorter files truncated, so they are processed from the
+ * start. Compressed files are processed again only if they changed.
+ *
+ * The file starts with a magic string, a byte order mark and an hash of
+ * the options that affect the statistics: the state is not loaded if it
+ * was created with different options. Then there are the counters, the
+ * arrays, the hashtables (keys and integer values) and the files. */
+
+#define VI_STATE_MAGIC "VISITORS-STATE-1"
+
+/* A log file processed with --state */
+struct vi_statefile {
+	char *filename;
+	long long dev;
+	long long ino;
+	long long size;		/* size when it was processed */
+	long long offset;	/* end of the last complete line processed */
+};
+
+struct vi_state {
+	struct vi_statefile *old;	/* files of the previous run */
+	int oldc;
+	struct vi_statefile *cur;	/* files of this run */
+	int curc;
+#ifdef VI_HAVE_PTHREADS
+	pthread_mutex_t lock;		/* workers add to 'cur' */
+#endif
+};
+
+/* Fill 't' with the hashtables of the handle, NULL terminated. The order
+ * is part of the state file format. */
+void vi_state_tables(struct vih *vih, struct hashtable **t)
+{
+	struct hashtable *tables[] = {
+		&vih->visitors, &vih->googlevisitors, &vih->pages,
+		&vih->images, &vih->error404, &vih->pageviews,
+		&vih->referers, &vih->referersage, &vih->date,
+		&vih->googledate, &vih->adsensed, &vih->month,
+		&vih->googlemonth, &vih->agents, &vih->googled,
+		&vih->googlevisits, &vih->googlekeyphrases,
+		&vih->googlekeyphrasesage, &vih->trails, &vih->tld, &vih->os,
+		&vih->browsers, &vih->robots, &vih->googlehumanlanguage,
+		&vih->screenres, &vih->screendepth, NULL
+	};
+
+	memcpy(t, tables, sizeof(tables));
+}
+
+/* Hash of the options that change what is collected. */
+unsigned int vi_state_options(void)
+{
+	char buf[256];
+	unsigned int h;
+	int i;
+
+	snprintf(buf, sizeof(buf),
+		"%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d%d:%d:%ld:%ld:%d:%d:%s",
+		Config_process_agents, Config_process_google,
+		Config_process_google_keyphrases,
+		Config_process_google_keyphrases_age,
+		Config_process_google_human_language,
+		Config_process_web_trails, Config_process_weekdayhour_map,
+		Config_process_monthday_map, Config_process_referers_age,
+		Config_process_tld, Config_process_os, Config_process_browsers,
+		Config_process_error404, Config_process_pageviews,
+		Config_process_monthly_visitors, Config_process_robots,
+		Config_process_screen_info, Config_filter_spam,
+		Config_ignore_404, Config_time_delta,
+		(long)Config_from, (long)Config_to, Config_display_fixed,
+		Config_display_offset, getenv("TZ") ? getenv("TZ") : "");
+	h = djb_hash((unsigned char*)buf, strlen(buf));
+	if (Config_log_format_string)
+		h = h*33 + djb_hash((unsigned char*)Config_log_format_string,
+				strlen(Config_log_format_string));
+	for (i = 0; i < Config_prefix_num; i++)
+		h = h*33 + djb_hash((unsigned char*)Config_prefix[i].str,
+				Config_prefix[i].len);
+	for (i = 0; i < Config_grep_pattern_num; i++) {
+		char *pattern = Config_grep_pattern[i].pattern;
+
+		h = h*33 + Config_grep_pattern[i].type +
+			djb_hash((unsigned char*)pattern, strlen(pattern));
+	}
+	return h;
+}
+
+static int vi_state_write_int(FILE *fp, long long v)
+{
+	return fwrite(&v, sizeof(v), 1, fp) != 1;
+}
+
+static int vi_state_write_str(FILE *fp, char *s)
+{
+	long long len = strlen(s);
+
+	return vi_state_write_int(fp, len) ||
+		fwrite(s, 1, len, fp) != (size_t)len;
+}
+
+static int vi_state_read_int(FILE *fp, long long *v)
+{
+	return fread(v, sizeof(*v), 1, fp) != 1;
+}
+
+/* Read a string, stored in a new allocation at 's'. */
+static int vi_state_read_str(FILE *fp, char **s)
+{
+	long long len;
+
+	if (vi_state_read_int(fp, &len) || len < 0 || len > (1<<30) ||
+	    (*s = malloc(len+1)) == NULL)
+		return 1;
+	if (fread(*s, 1, len, fp) != (size_t)len) {
+		free(*s);
+		return 1;
+	}
+	(*s)[len] = '\0';
+	return 0;
+}
+
+/* Read the integers of an array of 'n' int. */
+static int vi_state_read_ints(FILE *fp, int *a, int n)
+{
+	long long v;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (vi_state_read_int(fp, &v)) return 1;
+		a[i] = v;
+	}
+	return 0;
+}
+
+static int vi_state_write_ints(FILE *fp, int *a, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (vi_state_write_int(fp, a[i])) return 1;
+	return 0;
+}
+
+/* Load the state file 'filename' in the handle, that must be empty, and
+ * set the global state. A missing file is not an error: it's the first
+ * run. Returns non-zero on error, with the error set in the handle. */
+int vi_state_load(struct vih *vih, char *filename)
+{
+	struct hashtable *t[32];
+	char magic[sizeof(VI_STATE_MAGIC)-1];
+	long long v, count, j;
+	FILE *fp = NULL;
+	int i;
+
+	if ((State = calloc(1, sizeof(*State))) == NULL) goto oom;
+#ifdef VI_HAVE_PTHREADS
+	pthread_mutex_init(&State->lock, NULL);
+#endif
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		if (errno == ENOENT) return 0;
+		vi_set_error(vih, "Opening the state file '%s': %s", filename,
+				strerror(errno));
+		return 1;
+	}
+	if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	    memcmp(magic, VI_STATE_MAGIC, sizeof(magic)) ||
+	    vi_state_read_int(fp, &v) || v != 0x0102030405060708LL)
+		goto corrupted;
+	if (vi_state_read_int(fp, &v)) goto corrupted;
+	if (v != vi_state_options()) {
+		fprintf(stderr, "Note: the state file '%s' was created with "
+			"different options, processing all the data again\n",
+			filename);
+		fclose(fp);
+		return 0;
+	}
+	if (vi_state_read_int(fp, &v)) goto corrupted;
+	vih->processed = v;
+	if (vi_state_read_int(fp, &v)) goto corrupted;
+	vih->invalid = v;
+	if (vi_state_read_int(fp, &v)) goto corrupted;
+	vih->blacklisted = v;
+	if (vi_state_read_ints(fp, vih->hour, 24) ||
+	    vi_state_read_ints(fp, vih->weekday, 7) ||
+	    vi_state_read_ints(fp, &vih->weekdayhour[0][0], 7*24) ||
+	    vi_state_read_ints(fp, &vih->monthday[0][0], 12*31))
+		goto corrupted;
+	vi_state_tables(vih, t);
+	for (i = 0; t[i]; i++) {
+		if (vi_state_read_int(fp, &count) || count < 0) goto corrupted;
+		if (count && ht_expand(t[i], count*2) != HT_OK) goto oom;
+		for (j = 0; j < count; j++) {
+			char *key;
+
+			if (vi_state_read_str(fp, &key)) goto corrupted;
+			if (vi_state_read_int(fp, &v) ||
+			    ht_add(t[i], key, (void*)(long)v) != HT_OK)
+			{
+				free(key);
+				goto corrupted;
+			}
+		}
+	}
+	if (vi_state_read_int(fp, &count) || count < 0 || count > (1<<24))
+		goto corrupted;
+	if ((State->old = calloc(count+1, sizeof(struct vi_statefile))) == NULL)
+		goto oom;
+	for (j = 0; j < count; j++) {
+		struct vi_statefile *f = &State->old[j];
+
+		if (vi_state_read_str(fp, &f->filename)) goto corrupted;
+		State->oldc++;
+		if (vi_state_read_int(fp, &f->dev) ||
+		    vi_state_read_int(fp, &f->ino) ||
+		    vi_state_read_int(fp, &f->size) ||
+		    vi_state_read_int(fp, &f->offset))
+			goto corrupted;
+	}
+	fclose(fp);
+	return 0;
+corrupted:
+	fclose(fp);
+	vi_set_error(vih, "The state file '%s' is corrupted", filename);
+	return 1;
+oom:
+	if (fp) fclose(fp);
+	vi_set_error(vih, "Out of memory loading the state");
+	return 1;
+}
+
+/* Save the handle and the files processed in the state file 'filename'.
+ * The file is written atomically. Returns non-zero on error, with the
+ * error set in the handle. */
+int vi_state_save(struct vih *vih, char *filename)
+{
+	struct hashtable *t[32];
+	char *tmp;
+	FILE *fp;
+	int i, j;
+
+	if ((tmp = malloc(strlen(filename)+5)) == NULL) {
+		vi_set_error(vih, "Out of memory saving the state");
+		return 1;
+	}
+	sprintf(tmp, "%s.tmp", filename);
+	if ((fp = fopen(tmp, "wb")) == NULL) goto err;
+	if (fwrite(VI_STATE_MAGIC, strlen(VI_STATE_MAGIC), 1, fp) != 1 ||
+	    vi_state_write_int(fp, 0x0102030405060708LL) ||
+	    vi_state_write_int(fp, vi_state_options()) ||
+	    vi_state_write_int(fp, vih->processed) ||
+	    vi_state_write_int(fp, vih->invalid) ||
+	    vi_state_write_int(fp, vih->blacklisted) ||
+	    vi_state_write_ints(fp, vih->hour, 24) ||
+	    vi_state_write_ints(fp, vih->weekday, 7) ||
+	    vi_state_write_ints(fp, &vih->weekdayhour[0][0], 7*24) ||
+	    vi_state_write_ints(fp, &vih->monthday[0][0], 12*31))
+		goto err;
+	vi_state_tables(vih, t);
+	for (i = 0; t[i]; i++) {
+		if (vi_state_write_int(fp, ht_used(t[i]))) goto err;
+		for (j = 0; j < (int)ht_size(t[i]); j++) {
+			if (ht_get_byindex(t[i], j) != HT_FOUND) continue;
+			if (vi_state_write_str(fp, ht_key(t[i], j)) ||
+			    vi_state_write_int(fp, (long)ht_value(t[i], j)))
+				goto err;
+		}
+	}
+	if (vi_state_write_int(fp, State->curc)) goto err;
+	for (i = 0; i < State->curc; i++) {
+		struct vi_statefile *f = &State->cur[i];
+
+		if (vi_state_write_str(fp, f->filename) ||
+		    vi_state_write_int(fp, f->dev) ||
+		    vi_state_write_int(fp, f->ino) ||
+		    vi_state_write_int(fp, f->size) ||
+		    vi_state_write_int(fp, f->offset))
+			goto err;
+	}
+	if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) goto err;
+	if (fclose(fp) == EOF) {
+		fp = NULL;
+		goto err;
+	}
+	fp = NULL;
+	if (rename(tmp, filename) == -1) goto err;
+	free(tmp);
+	return 0;
+err:
+	vi_set_error(vih, "Saving the state in '%s': %s", filename,
+			strerror(errno));
+	if (fp) fclose(fp);
+	unlink(tmp);
+	free(tmp);
+	return 1;
+}
+
+/* Return the offset where to start processing the log file with the
+ * stat 'sb': the offset of the previous run, or zero if the
+ * file is new, rotated or truncated. The file is looked up by inode
+ * first, so that a rotated file processed again with its new name is
+ * resumed as well. For compressed files the size is returned if they
+ * did not change, zero otherwise. */
+off_t vi_state_offset(struct stat *sb, int compressed)
+{
+	struct vi_statefile *f = NULL;
+	int i;
+
+	for (i = 0; i < State->oldc; i++) {
+		if (State->old[i].dev == (long long)sb->st_dev &&
+		    State->old[i].ino == (long long)sb->st_ino)
+		{
+			f = &State->old[i];
+			break;
+		}
+	}
+	if (f == NULL) return 0;
+	if (compressed)
+		return f->size == sb->st_size ? sb->st_size : 0;
+	if (f->offset > sb->st_size) return 0; /* truncated */
+	return f->offset;
+}
+
+/* Record that 'filename', with the stat 'sb', was processed up to
+ * 'offset'. Called by the worker threads as well. */
+void vi_state_end(char *filename, struct stat *sb, off_t offset)
+{
+	struct vi_statefile *cur, *f;
+
+#ifdef VI_HAVE_PTHREADS
+	pthread_mutex_lock(&State->lock);
+#endif
+	if ((cur = realloc(State->cur,
+			sizeof(*cur)*(State->curc+1))) != NULL) {
+		State->cur = cur;
+		f = &cur[State->curc++];
+		f->filename = filename;
+		f->dev = sb->st_dev;
+		f->ino = sb->st_ino;
+		f->size = sb->st_size;
+		f->offset = offset;
+	}
+#ifdef VI_HAVE_PTHREADS
+	pthread_mutex_unlock(&State->lock);
+#endif
+}
+
+#ifdef VI_HAVE_PTHREADS
+/* A part of the input assigned to a worker thread: a whole file, or a
+ * range of lines of a file mapped in memory. */
+struct vi_part {
+	char *filename;
+	char *map;		/* the mapped file, NULL for a whole file */
+	size_t start;		/* range of the mapping to process */
+	size_t end;
+	size_t size;		/* size of the mapped file */
+	struct vi_w3c_columns w3c; /* W3C columns at 'start', see
+				      vi_logformat_seek() */
+	struct vi_logformat *format; /* see vi_select_format() */
+};
+
+/* A worker thread of vi_scan_files(), processing 'count' parts starting
+ * from 'part' with its own handle. */
+struct vi_worker {
+	pthread_t thread;
+	struct vih *vih;
+	struct vi_part *part;
+	int count;
+	int failed;		/* index of the part that failed, or -1 */
+};
+
+void *vi_worker_thread(void *arg)
+{
+	struct vi_worker *w = arg;
+	int i, retval;
+
+	for (i = 0; i < w->count; i++) {
+		struct vi_part *p = &w->part[i];
+
+		if (p->map == NULL && Config_io_uring) {
+			/* Read the consecutive whole files together. */
+			char **names;
+			int j, n = 0, failed = 0;
+
+			while(i+n < w->count && w->part[i+n].map == NULL) n++;
+			if ((names = malloc(sizeof(char*)*n)) == NULL) {
+				vi_set_error(w->vih, "Out of memory processing data");
+				w->failed = i;
+				break;
+			}
+			for (j = 0; j < n; j++) names[j] = w->part[i+j].filename;
+			retval = vi_scan_async(w->vih, names, n, &failed);
+			free(names);
+			if (retval) {
+				w->failed = i+failed;
+				break;
+			}
+			i += n-1;
+			continue;
+		}
+		if (p->map == NULL) {
+			retval = vi_scan(w->vih, p->filename);
+		} else {
+			/* With --state an incomplete last line is left
+			 * for the next run. */
+			Log_format = p->format;
+			vi_logformat_columns(&p->w3c);
+			retval = vi_process_range(w->vih, p->map+p->start,
+				p->end-p->start, p->end == p->size && !State);
+			vi_logformat_columns(NULL);
+			w->vih->endt = time(NULL);
+		}
+		if (retval) {
+			w->failed = i;
+			break;
+		}
+	}
+	return NULL;
+}
+
+#ifdef VI_HAVE_MMAP
+/* Map the file 'filename' in memory if it's a plain log file bigger than
+ * 'share' bytes, and split it in the parts stored at 'part', up to 'n'
+ * ranges of about the same size ending at a newline.
+ * Returns the number of parts, or zero if the file is not split. */
+int vi_split_file(struct vi_part *part, int n, char *filename, off_t share)
+{
+	struct stat sb;
+	struct vi_logformat *format = Config_log_format;
+	char *map, *name;
+	size_t size, start = 0, stop, first;
+	int fd, pieces, j = 0;
+
+	if ((fd = open(filename, O_RDONLY)) == -1) return 0;
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size <= share || sb.st_size < VI_SPLIT_MIN*2 ||
+	    (off_t)(size_t)sb.st_size != sb.st_size)
+	{
+		close(fd);
+		return 0;
+	}
+	size = sb.st_size;
+	map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+	if (vi_reader_detect(map, size) != VI_READER_PLAIN) {
+		munmap(map, size);
+		return 0;
+	}
+	/* With --state split just the data not yet processed, that ends
+	 * with the last newline of the file. */
+	if (State) {
+		size_t last = size;
+
+		start = vi_state_offset(&sb, 0);
+		if (size-start <= (size_t)share || size-start < VI_SPLIT_MIN*2) {
+			munmap(map, size);
+			return 0;
+		}
+		while(last > start && map[last-1] != '\n') last--;
+		vi_state_end(filename, &sb, last);
+	}
+	/* The format is reported by vi_scan() if the file is not split. */
+	if (Config_log_format_auto)
+		format = Log_format = vi_detect_format(map, size, &name);
+	/* With --from --to split just the lines inside the period. */
+	stop = size;
+	if (!State && (Config_from || Config_to)) {
+		vi_period_range(map, &start, &stop);
+		if (stop-start <= (size_t)share || stop-start < VI_SPLIT_MIN*2) {
+			munmap(map, size);
+			return 0;
+		}
+	}
+	first = start;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, size, MADV_SEQUENTIAL);
+#endif
+	pieces = (stop-start+share-1)/share;
+	if (pieces > (int)((stop-start)/VI_SPLIT_MIN))
+		pieces = (stop-start)/VI_SPLIT_MIN;
+	if (pieces > n) pieces = n;
+	while(start < stop) {
+		size_t end = stop;
+
+		if (j < pieces-1) {
+			char *nl;
+
+			end = first+(stop-first)/pieces*(j+1);
+			if (end < start) end = start;
+			nl = memchr(map+end, '\n', stop-end);
+			end = nl ? (size_t)(nl-map)+1 : stop;
+		}
+		part[j].filename = filename;
+		part[j].map = map;
+		part[j].start = start;
+		part[j].end = end;
+		part[j].size = size;
+		part[j].format = format;
+		/* The parts are processed at the same time: find the W3C
+		 * columns of every part now, looking back just up to the
+		 * previous part. */
+		if (j) part[j].w3c = part[j-1].w3c;
+		vi_logformat_columns(&part[j].w3c);
+		vi_logformat_seek(format, map, j ? part[j-1].start : 0, start);
+		vi_logformat_columns(NULL);
+		start = end;
+		j++;
+	}
+	if (Config_log_format_auto && Config_debug)
+		fprintf(stderr, "%s: %s log format\n", filename, name);
+	return j;
+}
+#endif
+
+/* Split the input in parts for 'n' workers: every file is a part, but
+ * big log files are split in multiple parts by vi_split_file().
+ * The number of parts is stored at 'parts'.
+ * Returns the array of parts, NULL on out of memory. */
+struct vi_part *vi_split_input(char **filenames, int count, int n,
+		int *parts)
+{
+	struct vi_part *part;
+	off_t total = 0;
+	int i;
+
+	if ((part = calloc(count*n, sizeof(*part))) == NULL) return NULL;
+	for (i = 0; i < count; i++) {
+		struct stat sb;
+
+		if (stat(filenames[i], &sb) == 0 && S_ISREG(sb.st_mode))
+			total += sb.st_size;
+	}
+	*parts = 0;
+	for (i = 0; i < count; i++) {
+		int split = 0;
+
+#ifdef VI_HAVE_MMAP
+		split = vi_split_file(part+*parts, n, filenames[i], total/n);
+#endif
+		if (split == 0) {
+			struct stat sb;
+
+			part[*parts].filename = filenames[i];
+			/* Pipes and stdin have no size, they count as one
+			 * byte. */
+			part[*parts].end = 1;
+			if (stat(filenames[i], &sb) == 0 && S_ISREG(sb.st_mode))
+				part[*parts].end += sb.st_size;
+			split = 1;
+		}
+		*parts += split;
+	}
+	return part;
+}
+
+/* Assign the parts in contiguous groups of about the same size to the
+ * 'n' workers. The first worker uses the handle 'vih', the others get a
+ * new handle that defers the new visits, see vi_merge().
+ * Returns non-zero on out of memory. */
+int vi_workers_init(struct vi_worker *w, int n, struct vih *vih,
+		struct vi_part *part, int parts)
+{
+	off_t total = 0, acc = 0;
+	int i, j;
+
+	for (j = 0; j < n; j++) {
+		w[j].vih = j == 0 ? vih : vi_new();
+		if (w[j].vih == NULL) return 1;
+		w[j].vih->threads = Config_threads/n;
+		w[j].vih->defer = j != 0;
+		/* The state before the first line is known by vi_merge(). */
+		if (j) w[j].vih->seen = 0;
+		w[j].count = 0;
+		w[j].failed = -1;
+	}
+	for (i = 0; i < parts; i++)
+		total += part[i].end-part[i].start;
+	j = 0;
+	w[0].part = part;
+	for (i = 0; i < parts; i++) {
+		acc += part[i].end-part[i].start;
+		w[j].count++;
+		/* Move to the next worker once this one got its share, but
+		 * leave at least a part to all the remaining workers. */
+		if (j < n-1 && (acc >= total/n*(j+1) || parts-i-1 == n-j-1)) {
+			j++;
+			w[j].part = part+i+1;
+		}
+	}
+	return 0;
+}
+#endif
+
+/* Process the specified log files. With --threads the input is split
+ * among threads, every thread processes its part with its own handle,
+ * and the handles are finally merged in 'vih' in the same order. Big
+ * log files are split at newline boundaries as well, so that even a
+ * single file is processed in parallel.
+ * Returns zero on success. On error non zero is returned, and the error
+ * was already reported. */
+int vi_scan_files(struct vih *vih, char **filenames, int count)
+{
+	int i;
+#ifdef VI_HAVE_PTHREADS
+	struct vi_worker *w;
+	struct vi_part *part;
+
+	if (Config_threads > 1 && count > 0 && !Config_merge) {
+		int j, n = Config_threads, parts, retval = 0;
+
+		if ((part = vi_split_input(filenames, count, n, &parts)) == NULL)
+			goto oom;
+		if (n > parts) n = parts;
+		if ((w = calloc(n, sizeof(*w))) == NULL ||
+		    vi_workers_init(w, n, vih, part, parts))
+			goto oom;
+		/* The first group is processed by this thread. If we can't
+		 * start a thread the work is done here as well. */
+		w[0].thread = pthread_self();
+		for (j = 1; j < n; j++) {
+			if (pthread_create(&w[j].thread, NULL, vi_worker_thread,
+						&w[j]))
+			{
+				vi_worker_thread(&w[j]);
+				w[j].thread = w[0].thread;
+			}
+		}
+		vi_worker_thread(&w[0]);
+		for (j = 1; j < n; j++) {
+			if (!pthread_equal(w[j].thread, w[0].thread))
+				pthread_join(w[j].thread, NULL);
+		}
+		for (j = 0; j < n; j++) {
+			if (w[j].failed != -1 && !retval) {
+				fprintf(stderr, "%s: %s\n",
+					w[j].part[w[j].failed].filename,
+					vi_get_error(w[j].vih));
+				retval = 1;
+			}
+			if (j == 0) continue;
+			if (!retval && vi_merge(vih, w[j].vih)) {
+				fprintf(stderr, "Out of memory merging data\n");
+				retval = 1;
+			}
+			vi_free(w[j].vih);
+		}
+#ifdef VI_HAVE_MMAP
+		for (i = 0; i < count*n; i++) {
+			/* The parts of a file are consecutive. */
+			if (part[i].map &&
+			    (i == 0 || part[i-1].map != part[i].map))
+				munmap(part[i].map, part[i].size);
+		}
+#endif
+		vih->threads = Config_threads;
+		free(part);
+		free(w);
+		return retval;
+	}
+#endif
+	if (Config_merge) {
+		if (vi_scan_merge(vih, filenames, count, &i)) {
+			fprintf(stderr, "%s: %s\n", filenames[i], vi_get_error(vih));
+			return 1;
+		}
+		return 0;
+	}
+	if (Config_io_uring) {
+		if (vi_scan_async(vih, filenames, count, &i)) {
+			fprintf(stderr, "%s: %s\n", filenames[i], vi_get_error(vih));
+			return 1;
+		}
+		return 0;
 	}
-	while (fgets(buf, VI_LINE_MAX, fp) != NULL) {
-		if (vi_process_line(vih, buf)) {
-			fclose(fp);
-			fprintf(stderr, "%s: %s\n", filename, vi_get_error(vih));
+	for (i = 0; i < count; i++) {
+		if (vi_scan(vih, filenames[i])) {
+			fprintf(stderr, "%s: %s\n", filenames[i], vi_get_error(vih));
 			return 1;
 		}
 	}
-	if (!use_stdin)
-		fclose(fp);
-	vih->endt = time(NULL);
 	return 0;
+#ifdef VI_HAVE_PTHREADS
+oom:
+	fprintf(stderr, "Out of memory processing data\n");
+	return 1;
+#endif
 }
 
-/* Postprocessing of pageviews per visit data.
- * The source hashtable entries are in the form: uniqe-visitor -> pageviews.
- * After the postprocessing we obtain another hashtable in the form:
- * pageviews-range -> quantity. This hashtable can be used directly
- * with generic output functions to generate the output. */
-int vi_postprocess_pageviews(struct vih *vih)
-{
-	void **table;
-	int len = ht_used(&vih->pageviews), i;
+/* ------------------------------- log families ----------------------------- */
+/* A log family is a log file together with its rotated siblings, like
+ * access.log, access.log.1, access.log.2.gz, ... The files are processed
+ * from the oldest to the newest, as a single log.
+ *
+ * Files are first sorted by modification time, that is about the time
+ * of their last entry, without opening them. This is enough to skip
+ * the files outside the --from --to period: a file modified before the
+ * start of the period only contains older entries, and a file older than
+ * a sibling modified after the end of the period only contains newer
+ * entries. The other files are ordered by the time of their first entry. */
+
+struct vi_member {
+	char *filename;
+	time_t mtime;		/* modification time, as a log time */
+	time_t first;		/* time of the first entry, or 'mtime' */
+};
 
-	if ((table = ht_get_array(&vih->pageviews)) == NULL) {
-		fprintf(stderr, "Out of memory in vi_postprocess_pageviews()\n");
-		return 1;
+/* Return the time of the first valid entry of a log file, looking only
+ * at its first block of data, or (time_t)-1 if there is none.
+ * Compressed files are decompressed as usually. */
+time_t vi_first_time(char *filename)
+{
+	struct vi_reader *r = NULL;
+	struct vi_w3c_columns cols;
+	char *buf = NULL, *l, *nl, *name;
+	time_t t = (time_t)-1;
+	long len = 0, n;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1) return t;
+	if ((buf = malloc(VI_FIRST_BLOCK)) == NULL ||
+	    (r = vi_reader_new_fd(fd)) == NULL) goto out;
+	while(len < VI_FIRST_BLOCK &&
+	      (n = vi_reader_read(r, buf+len, VI_FIRST_BLOCK-len)) > 0)
+		len += n;
+	/* The format is reported when the file is processed. */
+	if (Config_log_format_auto)
+		Log_format = vi_detect_format(buf, len, &name);
+	/* The W3C columns of this block are not the ones of the thread. */
+	cols.cols = 0;
+	vi_logformat_columns(&cols);
+	for (l = buf; t == (time_t)-1 &&
+	     (nl = memchr(l, '\n', len-(l-buf))) != NULL; l = nl+1)
+	{
+		struct logline ll;
+		char line[VI_LINE_MAX];
+
+		if (nl-l >= VI_LINE_MAX) continue;
+		memcpy(line, l, nl-l);
+		line[nl-l] = '\0';
+		if (vi_parse_line(&ll, line) == 0) t = ll.time;
 	}
-	/* Run the hashtable in order to populate 'pageviews_grouped' */
-	for (i = 0; i < len; i++) {
-		int pv = (long) table[(i*2)+1]; /* pageviews of visit */
-		int res;
-		char *key;
+	vi_logformat_columns(NULL);
+out:
+	if (r) vi_reader_free(r);
+	free(buf);
+	close(fd);
+	return t;
+}
 
-		if (pv == 1) key = "1";
-		else if (pv == 2) key = "2";
-		else if (pv == 3) key = "3";
-		else if (pv == 4) key = "4";
-		else if (pv == 5) key = "5";
-		else if (pv == 6) key = "6";
-		else if (pv == 7) key = "7";
-		else if (pv == 8) key = "8";
-		else if (pv == 9) key = "9";
-		else if (pv == 10) key = "10";
-		else if (pv >= 11 && pv <= 20) key = "11-20";
-		else if (pv >= 21 && pv <= 30) key = "21-30";
-		else key = "> 30";
+int qsort_cmp_member_mtime(const void *a, const void *b)
+{
+	const struct vi_member *ma = a, *mb = b;
 
-		res = vi_counter_incr(&vih->pageviews_grouped, key);
-		if (res == 0) {
-			free(table);
-			return 1; /* out of memory */
-		}
+	if (ma->mtime != mb->mtime) return (ma->mtime < mb->mtime) ? -1 : 1;
+	return strcmp(ma->filename, mb->filename);
+}
+
+int qsort_cmp_member_first(const void *a, const void *b)
+{
+	const struct vi_member *ma = a, *mb = b;
+
+	if (ma->first != mb->first) return (ma->first < mb->first) ? -1 : 1;
+	return qsort_cmp_member_mtime(a, b);
+}
+
+/* Return non-zero if 's', what follows the name of a log file in the
+ * name of another file, is the suffix of a rotated log: like ".1",
+ * ".2.gz" or "-20040510", or the empty string. */
+static int vi_rotation_suffix(const char *s)
+{
+	static const char *ext[] = {"", ".gz", ".bz2", ".xz", NULL};
+	int j;
+
+	if (*s == '\0') return 1;
+	if (*s == '-') {
+		/* logrotate dateext: a date, then anything. */
+		for (j = 1; j <= 8; j++)
+			if (!isdigit((unsigned char)s[j])) return 0;
+		return 1;
 	}
-	free(table);
+	if (*s != '.' || !isdigit((unsigned char)s[1])) return 0;
+	for (s++; isdigit((unsigned char)*s); s++);
+	for (j = 0; ext[j]; j++)
+		if (!strcmp(s, ext[j])) return 1;
 	return 0;
 }
 
-/* This function is called from vi_print_report() in order to
- * run some postprocessing to raw data collected needed to generate reports. */
-int vi_postprocess(struct vih *vih)
+/* Add the files of the log family 'pattern' to the 'count' filenames
+ * at 'filenames', in chronological order. The pattern is a glob pattern,
+ * a plain log file name matches the file and its rotated copies, see
+ * vi_rotation_suffix(). Returns zero on success. On error non zero is
+ * returned, and the error was already reported. */
+int vi_add_family(char *pattern, char **filenames, int *count)
 {
-	if (vi_postprocess_pageviews(vih)) goto oom;
+#ifdef VI_HAVE_GLOB
+	struct vi_member *m;
+	glob_t g;
+	char *p = pattern;
+	size_t i, plain = 0;
+	int j, n = 0, kept = 0, ret;
+
+	if (strpbrk(pattern, "*?[") == NULL) {
+		int len = strlen(pattern);
+
+		plain = len;
+		if ((p = malloc(len+2)) == NULL) goto oom;
+		memcpy(p, pattern, len);
+		memcpy(p+len, "*", 2);
+	}
+	ret = glob(p, 0, NULL, &g);
+	if (p != pattern) free(p);
+	if (ret == GLOB_NOSPACE) goto oom;
+	if (ret != 0) {
+		fprintf(stderr, "%s: no log files found\n", pattern);
+		return 1;
+	}
+	if ((m = malloc(sizeof(*m)*g.gl_pathc)) == NULL) {
+		globfree(&g);
+		goto oom;
+	}
+	for (i = 0; i < g.gl_pathc; i++) {
+		struct stat sb;
+
+		/* Don't process the state file as a log. */
+		if (Config_state_file &&
+		    !strcmp(g.gl_pathv[i], Config_state_file)) continue;
+		if (plain && !vi_rotation_suffix(g.gl_pathv[i]+plain))
+			continue;
+		if (stat(g.gl_pathv[i], &sb) == -1 || !S_ISREG(sb.st_mode))
+			continue;
+		m[n].filename = g.gl_pathv[i];
+		m[n].mtime = sb.st_mtime + Config_time_delta*3600;
+		n++;
+	}
+	if (n == 0) {
+		fprintf(stderr, "%s: no log files found\n", pattern);
+		free(m);
+		globfree(&g);
+		return 1;
+	}
+	qsort(m, n, sizeof(*m), qsort_cmp_member_mtime);
+	for (j = 0; j < n; j++) {
+		if ((Config_from && m[j].mtime < Config_from) ||
+		    (Config_to && j > 0 && m[j-1].mtime > Config_to))
+		{
+			if (Config_debug)
+				fprintf(stderr, "Skipping %s, outside the "
+						"period\n", m[j].filename);
+			continue;
+		}
+		m[kept] = m[j];
+		m[kept].first = vi_first_time(m[kept].filename);
+		if (m[kept].first == (time_t)-1) m[kept].first = m[kept].mtime;
+		kept++;
+	}
+	qsort(m, kept, sizeof(*m), qsort_cmp_member_first);
+	for (j = 0; j < kept; j++) {
+		if (*count == VI_FILENAMES_MAX) {
+			fprintf(stderr, "Too many log files specified\n");
+			exit(1);
+		}
+		if ((filenames[*count] = strdup(m[j].filename)) == NULL) {
+			free(m);
+			globfree(&g);
+			goto oom;
+		}
+		(*count)++;
+	}
+	free(m);
+	globfree(&g);
 	return 0;
 oom:
-	vi_set_error(vih, "Out of memory");
+	fprintf(stderr, "Out of memory processing %s\n", pattern);
+	return 1;
+#else
+	filenames = filenames;
+	count = count;
+	fprintf(stderr, "%s: --family is not supported on this system\n",
+			pattern);
 	return 1;
+#endif
 }
 
 /* ---------------------------- text output module -------------------------- */
@@ -2862,18 +5963,16 @@ void vi_print_generic_keytime_report(FILE *fp, char *title, char *subtitle,
 	}
 	qsort(table, items, sizeof(void*)*2, compar);
 	for (i = 0; i < items; i++) {
-		struct tm *tm;
+		struct tm tm;
 		char ftime[1024];
 		char *url = table[i*2];
 		time_t time = (time_t) table[(i*2)+1];
 		if (i >= maxlines) break;
-		tm = localtime(&time);
-		if (tm) {
-			ftime[0] = '\0';
-			strftime(ftime, 1024, "%d/%b/%Y", tm);
-			Output->print_keykey_entry(fp, ftime,
-					(url[0] == '\0') ? "none" : url, i+1);
-		}
+		vi_display_time(time, &tm);
+		ftime[0] = '\0';
+		strftime(ftime, 1024, "%d/%b/%Y", &tm);
+		Output->print_keykey_entry(fp, ftime,
+				(url[0] == '\0') ? "none" : url, i+1);
 	}
 	free(table);
 }
@@ -3277,20 +6376,55 @@ void vi_print_graphviz(struct vih *vih)
 }
 
 /* -------------------------------- stream mode ----------------------------- */
-void vi_stream_mode(struct vih *vih)
+/* Process the lines read from stdin forever, updating the report every
+ * Config_update_every seconds and resetting the statistics every
+ * Config_reset_every seconds. This is the portable implementation, also
+ * used when stdin can't be polled, like when it is a regular file.
+ * Stdin is read in blocks like the other inputs: an incomplete line is
+ * kept until its newline arrives, enlarging the buffer if needed. */
+void vi_stream_poll(struct vih *vih)
 {
 	time_t lastupdate_t, lastreset_t, now_t;
+	long size = VI_READ_CHUNK, len = 0, used;
+	int detected = 0;
+	char *buf;
 
+	if ((buf = malloc(size)) == NULL) {
+		fprintf(stderr, "Out of memory processing data\n");
+		return;
+	}
 	lastupdate_t = lastreset_t = time(NULL);
 	while(1) {
-		char buf[VI_LINE_MAX];
+		/* Always leave room for the nul term of the last line. */
+		ssize_t nread = read(STDIN_FILENO, buf+len, size-len-1);
 
-		if (fgets(buf, VI_LINE_MAX, stdin) == NULL) {
+		if (nread == -1 && errno == EINTR) continue;
+		if (nread <= 0) {
 			vi_sleep(1);
 			continue;
 		}
-		if (vi_process_line(vih, buf)) {
+		len += nread;
+		if (!detected) {
+			vi_select_format(NULL, buf, len);
+			detected = 1;
+		}
+		if ((used = vi_process_buffer(vih, buf, len)) == -1) {
 			fprintf(stderr, "%s\n", vi_get_error(vih));
+			used = len;
+		}
+		memmove(buf, buf+used, len-used);
+		len -= used;
+		if (len == size-1) {
+			char *newbuf = realloc(buf, size*2);
+
+			if (newbuf == NULL) {
+				fprintf(stderr, "Out of memory processing "
+						"data\n");
+				len = 0;
+			} else {
+				buf = newbuf;
+				size *= 2;
+			}
 		}
 		now_t = time(NULL);
 		/* update */
@@ -3310,10 +6444,499 @@ void vi_stream_mode(struct vih *vih)
 	}
 }
 
+#ifdef VI_HAVE_EPOLL
+/* Max number of reads from a source before to check the other ones */
+#define VI_STREAM_READS 8
+/* Max size of a datagram received by --stream-socket */
+#define VI_DGRAM_MAX 65536
+
+/* Events handled by the stream mode loop, other than VI_SOURCE_* */
+#define VI_SOURCE_STDIN 100
+#define VI_SOURCE_UPDATE 101	/* --update-every timer */
+#define VI_SOURCE_RESET 102	/* --reset-every timer */
+#define VI_SOURCE_INOTIFY 103	/* changes of the followed files */
+
+/* A descriptor of the stream mode event loop. */
+struct vi_source {
+	int type;
+	int fd;			/* -1 if closed */
+	char *path;
+	char *buf;		/* data read, the last line may be incomplete */
+	long size;
+	long len;
+	/* followed files */
+	const char *base;	/* name of the file inside its directory */
+	dev_t dev;		/* identity of the open file */
+	ino_t ino;
+	int wd;			/* watch of the file */
+	int dirwd;		/* watch of the directory */
+	struct vi_logformat *format; /* see vi_select_format() */
+	int detected;		/* non-zero once 'format' is selected */
+};
+
+/* Select the log format of the source on its first data, and use it
+ * for the lines parsed now. */
+static void vi_source_format(struct vi_source *src, char *buf, long len)
+{
+	if (!src->detected && len > 0) {
+		src->format = vi_select_format(src->path, buf, len);
+		src->detected = 1;
+	}
+	Log_format = src->format;
+}
+
+/* Add the source to the epoll instance. Returns non-zero on error. */
+static int vi_source_add(int epfd, struct vi_source *src)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev) == -1;
+}
+
+/* Create a timer firing every 'seconds' seconds. Returns non-zero on
+ * error. */
+static int vi_source_timer(int epfd, struct vi_source *src, int type,
+		int seconds)
+{
+	struct itimerspec its;
+
+	src->type = type;
+	if ((src->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1)
+		return 1;
+	if (seconds < 1) seconds = 1;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = its.it_interval.tv_sec = seconds;
+	return timerfd_settime(src->fd, 0, &its, NULL) == -1 ||
+		vi_source_add(epfd, src);
+}
+
+/* Write the report. This is done by a child process, working on a copy
+ * on write snapshot of the statistics, so that the new lines are
+ * processed while the report is generated. Returns the pid of the
+ * child, or zero if fork() failed and the report was written here. */
+static pid_t vi_stream_report(struct vih *vih)
+{
+	pid_t pid;
+
+	fflush(stdout);
+	fflush(stderr);
+	if ((pid = fork()) == 0) {
+		int retval = vi_print_report(Config_output_file, vih);
+
+		if (retval) fprintf(stderr, "%s\n", vi_get_error(vih));
+		fflush(NULL);
+		_exit(retval);
+	}
+	if (pid == -1) {
+		if (vi_print_report(Config_output_file, vih))
+			fprintf(stderr, "%s\n", vi_get_error(vih));
+		return 0;
+	}
+	return pid;
+}
+
+/* Process the complete lines in the buffer of the source, and the last
+ * line as well if 'last' is non-zero. The buffer is enlarged when a
+ * line does not fit. */
+static void vi_source_process(struct vih *vih, struct vi_source *src,
+		int last)
+{
+	long used;
+
+	vi_source_format(src, src->buf, src->len);
+	if ((used = vi_process_buffer(vih, src->buf, src->len)) == -1) {
+		fprintf(stderr, "%s\n", vi_get_error(vih));
+		used = src->len;
+	}
+	memmove(src->buf, src->buf+used, src->len-used);
+	src->len -= used;
+	if (last) {
+		if (vi_process_tail(vih, src->buf, src->len, 1))
+			fprintf(stderr, "%s\n", vi_get_error(vih));
+		src->len = 0;
+	}
+	if (src->len == src->size-1) {
+		char *newbuf = realloc(src->buf, src->size*2);
+
+		if (newbuf == NULL) {
+			fprintf(stderr, "Out of memory processing data\n");
+			src->len = 0;
+		} else {
+			src->buf = newbuf;
+			src->size *= 2;
+		}
+	}
+}
+
+/* Read from the source what is available, up to VI_STREAM_READS blocks,
+ * and process the complete lines. Returns non-zero on end of file. */
+static int vi_source_read(struct vih *vih, struct vi_source *src)
+{
+	int j;
+
+	for (j = 0; j < VI_STREAM_READS; j++) {
+		/* Always leave room for the nul term of the last line. */
+		ssize_t nread = read(src->fd, src->buf+src->len,
+				src->size-src->len-1);
+
+		if (nread == -1 && errno == EINTR) continue;
+		if (nread == -1 && errno == EAGAIN) return 0;
+		if (nread <= 0) {
+			if (nread == -1)
+				fprintf(stderr, "Reading from '%s': %s\n",
+					src->path, strerror(errno));
+			vi_source_process(vih, src, 1);
+			return 1;
+		}
+		src->len += nread;
+		vi_source_process(vih, src, 0);
+	}
+	return 0;
+}
+
+/* Skip the header of a syslog message, in the RFC 3164 form
+ * "<PRI>Mmm dd hh:mm:ss [host] tag: " or in the RFC 5424 form
+ * "<PRI>1 timestamp host app procid msgid sd ". Messages not starting
+ * with a priority are returned as they are. */
+static char *vi_syslog_strip(char *p)
+{
+	char *q = p, *colon;
+	int j;
+
+	if (*q++ != '<') return p;
+	while(isdigit((unsigned char)*q)) q++;
+	if (*q++ != '>') return p;
+	if (q[0] == '1' && q[1] == ' ') {
+		/* Version, timestamp, host, app, procid, msgid. */
+		for (j = 0; j < 6 && q; j++)
+			if ((q = strchr(q, ' ')) != NULL) q++;
+		if (q == NULL) return p;
+		/* Structured data: '-' or a list of [elements]. */
+		if (*q == '-') {
+			q++;
+		} else {
+			while(*q == '[') {
+				while(*q && *q != ']') {
+					if (*q == '\\' && q[1]) q++;
+					q++;
+				}
+				if (*q) q++;
+			}
+		}
+		if (*q == ' ') q++;
+		return q;
+	}
+	/* The timestamp is always 15 chars. */
+	if (strlen(q) > 16 && q[3] == ' ' && q[6] == ' ' && q[9] == ':' &&
+	    q[12] == ':' && q[15] == ' ')
+		q += 16;
+	/* Host and tag: a tag ends with ':' and comes within two words. */
+	for (colon = q, j = 0; j < 2 && *colon; j++) {
+		char *sp = strchr(colon, ' ');
+
+		if (sp == NULL) break;
+		if (sp > colon && sp[-1] == ':') return sp+1;
+		colon = sp+1;
+	}
+	return q;
+}
+
+/* Receive the datagrams waiting on the socket, every datagram is one
+ * or more log lines, possibly with a syslog header. */
+static void vi_source_recv(struct vih *vih, struct vi_source *src)
+{
+	int j;
+
+	for (j = 0; j < VI_STREAM_READS*8; j++) {
+		ssize_t n = recv(src->fd, src->buf, src->size-1, 0);
+		char *line;
+		long used, len;
+
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return;
+		src->buf[n] = '\0';
+		line = vi_syslog_strip(src->buf);
+		len = n-(line-src->buf);
+		vi_source_format(src, line, len);
+		if ((used = vi_process_buffer(vih, line, len)) == -1 ||
+		    vi_process_tail(vih, line+used, len-used, 1))
+			fprintf(stderr, "%s\n", vi_get_error(vih));
+	}
+}
+
+/* Open a followed file, at its end if 'atend' is non-zero, and watch
+ * it. Returns non-zero if the file can't be opened. */
+static int vi_source_follow(int ifd, struct vi_source *src, int atend)
+{
+	struct stat sb;
+
+	if ((src->fd = open(src->path, O_RDONLY)) == -1) return 1;
+	if (fstat(src->fd, &sb) == -1 ||
+	    (atend && lseek(src->fd, 0, SEEK_END) == -1))
+	{
+		close(src->fd);
+		src->fd = -1;
+		return 1;
+	}
+	src->dev = sb.st_dev;
+	src->ino = sb.st_ino;
+	src->wd = inotify_add_watch(ifd, src->path,
+			IN_MODIFY|IN_MOVE_SELF|IN_DELETE_SELF|IN_ATTRIB);
+	return 0;
+}
+
+/* Process the new data of a followed file. If the file was rotated the
+ * rest of the old file is processed, then the new one from the start.
+ * Truncated files are read again from the start. */
+static void vi_source_check(struct vih *vih, int ifd, struct vi_source *src)
+{
+	struct stat sb;
+
+	if (src->fd == -1 && vi_source_follow(ifd, src, 0)) return;
+	if (fstat(src->fd, &sb) == 0 && sb.st_size < lseek(src->fd, 0, SEEK_CUR))
+		lseek(src->fd, 0, SEEK_SET);
+	while(src->fd != -1) {
+		/* Read up to the end of the file. */
+		while(1) {
+			ssize_t nread = read(src->fd, src->buf+src->len,
+					src->size-src->len-1);
+
+			if (nread == -1 && errno == EINTR) continue;
+			if (nread <= 0) break;
+			src->len += nread;
+			vi_source_process(vih, src, 0);
+		}
+		/* Keep following the old file until a new one is created. */
+		if (stat(src->path, &sb) == -1 ||
+		    (sb.st_dev == src->dev && sb.st_ino == src->ino))
+			break;
+		vi_source_process(vih, src, 1);
+		if (src->wd != -1) inotify_rm_watch(ifd, src->wd);
+		close(src->fd);
+		src->fd = src->wd = -1;
+		if (vi_source_follow(ifd, src, 0)) break;
+	}
+}
+
+/* Open the source 'src' according to its type. Returns non-zero on
+ * error, with errno set. */
+static int vi_source_open(int epfd, int ifd, struct vi_source *src)
+{
+	struct sockaddr_un sa;
+	struct stat sb;
+	char *slash, *dir;
+
+	switch(src->type) {
+	case VI_SOURCE_FIFO:
+		/* Opened for writing as well, so that there is no end of
+		 * file when the writers go away. */
+		if (mkfifo(src->path, 0666) == -1 && errno != EEXIST)
+			return 1;
+		if ((src->fd = open(src->path, O_RDWR|O_NONBLOCK)) == -1)
+			return 1;
+		break;
+	case VI_SOURCE_SOCKET:
+		if (strlen(src->path) >= sizeof(sa.sun_path)) {
+			errno = ENAMETOOLONG;
+			return 1;
+		}
+		memset(&sa, 0, sizeof(sa));
+		sa.sun_family = AF_UNIX;
+		strcpy(sa.sun_path, src->path);
+		/* Remove the socket left by a previous run. */
+		if (lstat(src->path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+			unlink(src->path);
+		if ((src->fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1 ||
+		    bind(src->fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+		    fcntl(src->fd, F_SETFL, O_NONBLOCK) == -1)
+			return 1;
+		src->size = VI_DGRAM_MAX+1;
+		break;
+	case VI_SOURCE_FOLLOW:
+		if (ifd == -1) return 1;
+		slash = strrchr(src->path, '/');
+		src->base = slash ? slash+1 : src->path;
+		if (slash == NULL) {
+			dir = ".";
+		} else if ((dir = strdup(src->path)) != NULL) {
+			dir[slash-src->path+(slash == src->path)] = '\0';
+		}
+		if (dir == NULL) return 1;
+		src->dirwd = inotify_add_watch(ifd, dir, IN_CREATE|IN_MOVED_TO);
+		if (slash) free(dir);
+		/* A missing file is followed as soon as it is created. */
+		src->fd = src->wd = -1;
+		vi_source_follow(ifd, src, 1);
+		break;
+	}
+	if ((src->buf = malloc(src->size)) == NULL) return 1;
+	if (src->type != VI_SOURCE_FOLLOW && vi_source_add(epfd, src))
+		return 1;
+	return 0;
+}
+#endif
+
+/* Stream mode: process the lines from stdin as they arrive. Where epoll
+ * is available stdin is non blocking and is read in big blocks as soon
+ * as data is ready, and the report and reset deadlines are timerfd
+ * timers, so there is no polling and there are no system calls for
+ * every line. More sources can feed the same statistics: named pipes,
+ * followed files and an AF_UNIX datagram socket receiving syslog
+ * messages. When all the sources are closed the report is written a
+ * last time. */
+void vi_stream_mode(struct vih *vih)
+{
+#ifdef VI_HAVE_EPOLL
+	struct vi_source *sources, *src, *stdinsrc, *updatesrc;
+	int epfd, ifd, flags = -1, fresh = 0, active, nsrc, i;
+	pid_t child = 0;
+
+	nsrc = Config_stream_source_num+4;
+	if ((sources = calloc(nsrc, sizeof(*sources))) == NULL) {
+		fprintf(stderr, "Out of memory processing data\n");
+		return;
+	}
+	for (i = 0; i < nsrc; i++) {
+		sources[i].fd = sources[i].wd = sources[i].dirwd = -1;
+		sources[i].size = VI_READ_CHUNK;
+	}
+	stdinsrc = &sources[0];
+	stdinsrc->type = VI_SOURCE_STDIN;
+	stdinsrc->path = "stdin";
+	stdinsrc->fd = 0;
+	updatesrc = &sources[1];
+	if ((epfd = epoll_create(nsrc)) == -1 ||
+	    vi_source_timer(epfd, updatesrc, VI_SOURCE_UPDATE,
+		    Config_update_every) ||
+	    (Config_reset_every && vi_source_timer(epfd, &sources[2],
+		    VI_SOURCE_RESET, Config_reset_every)) ||
+	    (stdinsrc->buf = malloc(stdinsrc->size)) == NULL)
+	{
+		perror("Starting the stream mode");
+		exit(1);
+	}
+	/* Stdin can't be polled if it's a regular file or a device like
+	 * /dev/null: without other sources use the old loop for it,
+	 * otherwise ignore it. */
+	active = Config_stream_source_num;
+	if ((flags = fcntl(0, F_GETFL)) != -1 &&
+	    fcntl(0, F_SETFL, flags|O_NONBLOCK) != -1 &&
+	    vi_source_add(epfd, stdinsrc) == 0)
+	{
+		active++;
+	} else if (active == 0) {
+		vi_stream_poll(vih);
+		return;
+	}
+	sources[3].type = VI_SOURCE_INOTIFY;
+	if ((ifd = sources[3].fd = inotify_init()) != -1)
+		vi_source_add(epfd, &sources[3]);
+	for (i = 0; i < Config_stream_source_num; i++) {
+		src = &sources[4+i];
+		src->type = Config_stream_source[i].type;
+		src->path = Config_stream_source[i].path;
+		if (vi_source_open(epfd, ifd, src)) {
+			fprintf(stderr, "Stream source '%s': %s\n", src->path,
+				strerror(errno));
+			exit(1);
+		}
+	}
+	while(active) {
+		struct epoll_event events[16];
+		int n, j, update = 0, reset = 0;
+		unsigned long long expired;
+		long evbuf[1024];
+		ssize_t len;
+		char *p;
+
+		if ((n = epoll_wait(epfd, events, 16, -1)) == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
+			break;
+		}
+		for (j = 0; j < n; j++) {
+			src = events[j].data.ptr;
+			switch(src->type) {
+			case VI_SOURCE_STDIN:
+			case VI_SOURCE_FIFO:
+				fresh = 1;
+				if (vi_source_read(vih, src)) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+					active--;
+				}
+				break;
+			case VI_SOURCE_SOCKET:
+				fresh = 1;
+				vi_source_recv(vih, src);
+				break;
+			case VI_SOURCE_UPDATE:
+			case VI_SOURCE_RESET:
+				if (read(src->fd, &expired, sizeof(expired)) > 0) {
+					if (src == updatesrc) update = 1;
+					else reset = 1;
+				}
+				break;
+			case VI_SOURCE_INOTIFY:
+				if ((len = read(ifd, evbuf, sizeof(evbuf))) <= 0)
+					break;
+				for (p = (char*)evbuf; p < (char*)evbuf+len;
+				     p += sizeof(struct inotify_event) +
+					  ((struct inotify_event*)p)->len)
+				{
+					struct inotify_event *ev = (void*)p;
+
+					for (i = 4; i < nsrc; i++) {
+						struct vi_source *f = &sources[i];
+
+						if (f->type != VI_SOURCE_FOLLOW)
+							continue;
+						if (ev->mask & IN_Q_OVERFLOW ||
+						    (f->wd != -1 && ev->wd == f->wd) ||
+						    (ev->wd == f->dirwd && ev->len &&
+						     !strcmp(ev->name, f->base)))
+						{
+							vi_source_check(vih, ifd, f);
+							fresh = 1;
+						}
+					}
+				}
+				break;
+			}
+		}
+		/* Followed files are checked at every update as well, since
+		 * inotify does not work on every filesystem. */
+		for (i = 4; update && i < nsrc; i++) {
+			if (sources[i].type == VI_SOURCE_FOLLOW) {
+				vi_source_check(vih, ifd, &sources[i]);
+				fresh = 1;
+			}
+		}
+		/* On the same tick the report comes first, then the reset.
+		 * The report is only updated if new data arrived. */
+		if ((update || !active) && fresh) {
+			if (child) waitpid(child, NULL, 0);
+			child = vi_stream_report(vih);
+			fresh = 0;
+		}
+		if (reset) vi_reset(vih);
+	}
+	if (child) waitpid(child, NULL, 0);
+	fcntl(0, F_SETFL, flags);
+#else
+	if (Config_stream_source_num)
+		fprintf(stderr, "Stream sources other than stdin are not "
+				"supported on this system\n");
+	vi_stream_poll(vih);
+#endif
+}
+
 /* ----------------------------------- main --------------------------------- */
 
 /* command line switche IDs */
-enum { OPT_MAXREFERERS, OPT_MAXPAGES, OPT_MAXIMAGES, OPT_USERAGENTS, OPT_ALL, OPT_MAXLINES, OPT_GOOGLE, OPT_MAXGOOGLED, OPT_MAXUSERAGENTS, OPT_OUTPUT, OPT_VERSION, OPT_HELP, OPT_PREFIX, OPT_TRAILS, OPT_GOOGLEKEYPHRASES, OPT_GOOGLEKEYPHRASESAGE, OPT_MAXGOOGLEKEYPHRASES, OPT_MAXGOOGLEKEYPHRASESAGE, OPT_MAXTRAILS, OPT_GRAPHVIZ, OPT_WEEKDAYHOUR_MAP, OPT_MONTHDAY_MAP, OPT_REFERERSAGE, OPT_MAXREFERERSAGE, OPT_TAIL, OPT_TLD, OPT_MAXTLD, OPT_STREAM, OPT_OUTPUTFILE, OPT_UPDATEEVERY, OPT_RESETEVERY, OPT_OS, OPT_BROWSERS, OPT_ERROR404, OPT_MAXERROR404, OPT_TIMEDELTA, OPT_PAGEVIEWS, OPT_ROBOTS, OPT_MAXROBOTS, OPT_GRAPHVIZ_ignorenode_GOOGLE, OPT_GRAPHVIZ_ignorenode_EXTERNAL, OPT_GRAPHVIZ_ignorenode_NOREFERER, OPT_GOOGLEHUMANLANGUAGE, OPT_FILTERSPAM, OPT_MAXADSENSED, OPT_GREP, OPT_EXCLUDE, OPT_IGNORE404, OPT_DEBUG, OPT_SCREENINFO};
+enum { OPT_MAXREFERERS, OPT_MAXPAGES, OPT_MAXIMAGES, OPT_USERAGENTS, OPT_ALL, OPT_MAXLINES, OPT_GOOGLE, OPT_MAXGOOGLED, OPT_MAXUSERAGENTS, OPT_OUTPUT, OPT_VERSION, OPT_HELP, OPT_PREFIX, OPT_TRAILS, OPT_GOOGLEKEYPHRASES, OPT_GOOGLEKEYPHRASESAGE, OPT_MAXGOOGLEKEYPHRASES, OPT_MAXGOOGLEKEYPHRASESAGE, OPT_MAXTRAILS, OPT_GRAPHVIZ, OPT_WEEKDAYHOUR_MAP, OPT_MONTHDAY_MAP, OPT_REFERERSAGE, OPT_MAXREFERERSAGE, OPT_TAIL, OPT_TLD, OPT_MAXTLD, OPT_STREAM, OPT_OUTPUTFILE, OPT_UPDATEEVERY, OPT_RESETEVERY, OPT_OS, OPT_BROWSERS, OPT_ERROR404, OPT_MAXERROR404, OPT_TIMEDELTA, OPT_PAGEVIEWS, OPT_ROBOTS, OPT_MAXROBOTS, OPT_GRAPHVIZ_ignorenode_GOOGLE, OPT_GRAPHVIZ_ignorenode_EXTERNAL, OPT_GRAPHVIZ_ignorenode_NOREFERER, OPT_GOOGLEHUMANLANGUAGE, OPT_FILTERSPAM, OPT_MAXADSENSED, OPT_GREP, OPT_EXCLUDE, OPT_IGNORE404, OPT_DEBUG, OPT_SCREENINFO, OPT_THREADS, OPT_IOURING, OPT_STREAMFIFO, OPT_STREAMFOLLOW, OPT_STREAMSOCKET, OPT_STATE, OPT_FAMILY, OPT_FROM, OPT_TO, OPT_MERGE, OPT_DISPLAYZONE, OPT_LOGFORMAT};
 
 /* command line switches definition:
  * the rule with short options is to take upper case the
@@ -3337,6 +6960,9 @@ static struct ago_optlist visitors_optlist[] = {
 	{ 'S',	"robots",		OPT_ROBOTS,		AGO_NOARG},
 	{ '\0',	"screen-info",		OPT_SCREENINFO,		AGO_NOARG},
 	{ '\0', "stream",		OPT_STREAM,		AGO_NOARG},
+	{ '\0', "stream-fifo",		OPT_STREAMFIFO,		AGO_NEEDARG},
+	{ '\0', "stream-follow",	OPT_STREAMFOLLOW,	AGO_NEEDARG},
+	{ '\0', "stream-socket",	OPT_STREAMSOCKET,	AGO_NEEDARG},
 	{ '\0', "update-every",		OPT_UPDATEEVERY,	AGO_NEEDARG},
 	{ '\0',	"reset-every",		OPT_RESETEVERY,		AGO_NEEDARG},
 	{ 'f',	"output-file",		OPT_OUTPUTFILE,		AGO_NEEDARG},
@@ -3369,9 +6995,18 @@ static struct ago_optlist visitors_optlist[] = {
 	{ 'v',  "version",		OPT_VERSION,		AGO_NOARG},
 	{ '\0', "tail",			OPT_TAIL,		AGO_NOARG},
 	{ '\0', "time-delta",		OPT_TIMEDELTA,		AGO_NEEDARG},
+	{ '\0', "display-zone",		OPT_DISPLAYZONE,	AGO_NEEDARG},
+	{ '\0', "log-format",		OPT_LOGFORMAT,		AGO_NEEDARG},
         { '\0', "filter-spam",          OPT_FILTERSPAM,         AGO_NOARG},
         { '\0', "ignore-404",           OPT_IGNORE404,          AGO_NOARG},
 	{ '\0',	"debug",		OPT_DEBUG,		AGO_NOARG},
+	{ '\0',	"threads",		OPT_THREADS,		AGO_NEEDARG},
+	{ '\0',	"io-uring",		OPT_IOURING,		AGO_NOARG},
+	{ '\0',	"state",		OPT_STATE,		AGO_NEEDARG},
+	{ '\0',	"family",		OPT_FAMILY,		AGO_NEEDARG},
+	{ '\0',	"merge",		OPT_MERGE,		AGO_NOARG},
+	{ '\0',	"from",			OPT_FROM,		AGO_NEEDARG},
+	{ '\0',	"to",			OPT_TO,			AGO_NEEDARG},
 	{ 'h',	"help",			OPT_HELP,		AGO_NOARG},
 	AGO_LIST_TERM
 };
@@ -3400,10 +7035,14 @@ void visitors_show_help(void)
 
 int main(int argc, char **argv)
 {
-	int i, o;
+	int o;
 	struct vih *vih;
 	char *filenames[VI_FILENAMES_MAX];
 	int filenamec = 0;
+	char *families[VI_FAMILIES_MAX];
+	int familyc = 0, i;
+	char *from = NULL, *to = NULL;
+	char err[128];
 
 	/* Handle command line options */
 	while((o = antigetopt(argc, argv, visitors_optlist)) != AGO_EOF) {
@@ -3594,6 +7233,32 @@ int main(int argc, char **argv)
 		case OPT_TIMEDELTA:
 			Config_time_delta = atoi(ago_optarg);
 			break;
+		case OPT_LOGFORMAT:
+			/* With 'auto' the format of every input is detected,
+			 * see vi_select_format(). */
+			Config_log_format_auto = !strcmp(ago_optarg, "auto");
+			Config_log_format = NULL;
+			if (Config_log_format_auto) {
+				if (vi_auto_init()) {
+					fprintf(stderr, "Invalid --log-format: "
+						"can't compile the formats\n");
+					exit(1);
+				}
+			} else if ((Config_log_format =
+				    vi_logformat_compile(ago_optarg,
+					err, sizeof(err))) == NULL) {
+				fprintf(stderr, "Invalid --log-format: %s\n", err);
+				exit(1);
+			}
+			Config_log_format_string = ago_optarg;
+			break;
+		case OPT_DISPLAYZONE:
+			if (vi_set_display_zone(ago_optarg)) {
+				fprintf(stderr, "Invalid --display-zone '%s'\n",
+					ago_optarg);
+				exit(1);
+			}
+			break;
                 case OPT_FILTERSPAM:
                         Config_filter_spam = 1;
                         break;
@@ -3612,6 +7277,45 @@ int main(int argc, char **argv)
                 case OPT_SCREENINFO:
                         Config_process_screen_info = 1;
                         break;
+		case OPT_THREADS:
+			Config_threads = atoi(ago_optarg);
+			if (Config_threads < 1 || Config_threads > VI_THREADS_MAX) {
+				fprintf(stderr, "--threads must be between 1 and %d\n",
+						VI_THREADS_MAX);
+				exit(1);
+			}
+			break;
+		case OPT_IOURING:
+			Config_io_uring = 1;
+			break;
+		case OPT_STATE:
+			Config_state_file = ago_optarg;
+			break;
+		case OPT_FAMILY:
+			if (familyc == VI_FAMILIES_MAX) {
+				fprintf(stderr, "Too many log families specified\n");
+				exit(1);
+			}
+			families[familyc++] = ago_optarg;
+			break;
+		case OPT_MERGE:
+			Config_merge = 1;
+			break;
+		case OPT_FROM:
+			from = ago_optarg;
+			break;
+		case OPT_TO:
+			to = ago_optarg;
+			break;
+		case OPT_STREAMFIFO:
+			ConfigAddStreamSource(ago_optarg, VI_SOURCE_FIFO);
+			break;
+		case OPT_STREAMFOLLOW:
+			ConfigAddStreamSource(ago_optarg, VI_SOURCE_FOLLOW);
+			break;
+		case OPT_STREAMSOCKET:
+			ConfigAddStreamSource(ago_optarg, VI_SOURCE_SOCKET);
+			break;
 		case AGO_ALONE:
 			if (filenamec < VI_FILENAMES_MAX)
 				filenames[filenamec++] = ago_optarg;
@@ -3624,8 +7328,25 @@ int main(int argc, char **argv)
 		vi_tail(filenamec, filenames);
 		return 0;
 	}
+	/* Convert the --from --to dates. A day without the time
+	 * includes all the entries of the day. */
+	if (from && (Config_from = parse_date(from, NULL)) == (time_t)-1) {
+		fprintf(stderr, "Invalid --from date '%s'\n", from);
+		exit(1);
+	}
+	if (to && (Config_to = parse_date(to, NULL)) == (time_t)-1) {
+		fprintf(stderr, "Invalid --to date '%s'\n", to);
+		exit(1);
+	}
+	if (to && strchr(to, ':') == NULL)
+		Config_to += 3600*24-1;
+	/* Add the files of the log families, oldest first. */
+	for (i = 0; i < familyc; i++) {
+		if (vi_add_family(families[i], filenames, &filenamec))
+			exit(1);
+	}
 	/* Check if at least one file was specified */
-	if (filenamec == 0 && !Config_stream_mode) {
+	if (filenamec == 0 && familyc == 0 && !Config_stream_mode) {
 		fprintf(stderr, "No logfile specified\n");
 		visitors_show_help();
 		exit(1);
@@ -3641,6 +7362,10 @@ int main(int argc, char **argv)
             fprintf(stderr, "Note: 404 error processing enabled for screen-info report\n");
             Config_process_error404 = 1;
         }
+	/* Parse just the fields needed by the enabled reports. */
+	Config_fields = vi_needed_fields();
+	if (Config_log_format) vi_logformat_mask(Config_log_format, Config_fields);
+	if (Config_log_format_auto) vi_auto_mask(Config_fields);
 	/* If stream-mode is enabled, --output-file should be specified. */
 	if (Config_stream_mode && Config_output_file == NULL) {
 		fprintf(stderr, "--stream requires --output-file\n");
@@ -3653,12 +7378,30 @@ int main(int argc, char **argv)
 	setlocale(LC_ALL, "C");
 	/* Process all the log files specified. */
 	vih = vi_new();
-	for (i = 0; i < filenamec; i++) {
-		if (vi_scan(vih, filenames[i])) {
-			fprintf(stderr, "%s: %s\n", filenames[i], vi_get_error(vih));
+	if (Config_state_file) {
+#ifndef VI_HAVE_MMAP
+		fprintf(stderr, "--state is not supported on this system\n");
+		exit(1);
+#endif
+		if (Config_merge) {
+			fprintf(stderr, "--state can't be used with --merge\n");
+			exit(1);
+		}
+		if (Config_io_uring) {
+			fprintf(stderr, "Note: --io-uring is ignored with --state\n");
+			Config_io_uring = 0;
+		}
+		if (vi_state_load(vih, Config_state_file)) {
+			fprintf(stderr, "%s\n", vi_get_error(vih));
 			exit(1);
 		}
 	}
+	if (vi_scan_files(vih, filenames, filenamec))
+		exit(1);
+	if (State && vi_state_save(vih, Config_state_file)) {
+		fprintf(stderr, "%s\n", vi_get_error(vih));
+		exit(1);
+	}
 	if (Config_graphviz_mode) {
 		vi_print_graphviz(vih);
 	} else {